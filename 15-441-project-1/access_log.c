@@ -0,0 +1,164 @@
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "access_log.h"
+#include "io.h"
+#include "utils.h"
+#include "log.h"
+
+// the longest line: every field at its maximum, the path fully escaped
+#define ACCESS_LOG_MAX_LINE_SIZE (ACCESS_LOG_MAX_PATH_SIZE * 6 + 512)
+
+static int fd = -1;
+static int sample_rate;
+static unsigned int sample_count;
+
+static char buf[ACCESS_LOG_BUFFER_SIZE];
+static int buf_len;
+static long long buf_since;
+
+int access_log_init(const char* filename, int rate) {
+    sample_rate = rate > 0 ? rate : 1;
+    sample_count = 0;
+    buf_len = 0;
+    if (filename == NULL) {
+        fd = -1;
+        return 1;
+    }
+    fd = open(filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        log_(LOG_ERROR, "Error opening the access log %s\n", filename);
+        return 0;
+    }
+    return 1;
+}
+
+int access_log_sample() {
+    return fd >= 0 && sample_count++ % sample_rate == 0;
+}
+
+static void flush() {
+    int written = 0;
+    while (written < buf_len) {
+        int ret = write(fd, buf + written, buf_len - written);
+        if (ret <= 0) {
+            break;
+        }
+        written += ret;
+    }
+    buf_len = 0;
+}
+
+/*
+ * A small formatter writing straight into the line, nothing is allocated
+ * and printf isn't involved.
+ */
+static char* put_str(char* p, const char* str) {
+    while (*str) {
+        *p++ = *str++;
+    }
+    return p;
+}
+
+static char* put_int(char* p, long long value) {
+    char digits[24];
+    int n = 0;
+    unsigned long long v = value < 0 ? -(unsigned long long) value : value;
+    do {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v > 0);
+    if (value < 0) {
+        *p++ = '-';
+    }
+    while (n > 0) {
+        *p++ = digits[--n];
+    }
+    return p;
+}
+
+static char* put_json_str(char* p, const char* str) {
+    static const char hex[] = "0123456789abcdef";
+    *p++ = '"';
+    for (; *str; ++str) {
+        unsigned char ch = *str;
+        if (ch == '"' || ch == '\\') {
+            *p++ = '\\';
+            *p++ = ch;
+        } else if (ch < 0x20 || ch >= 0x7f) {
+            p = put_str(p, "\\u00");
+            *p++ = hex[ch >> 4];
+            *p++ = hex[ch & 15];
+        } else {
+            *p++ = ch;
+        }
+    }
+    *p++ = '"';
+    return p;
+}
+
+// null if the request never got there
+static char* put_time(char* p, const char* name, long long at) {
+    p = put_str(p, name);
+    return at > 0 ? put_int(p, at) : put_str(p, "null");
+}
+
+void access_log_write(const AccessRecord* record, struct in_addr addr, int is_tls) {
+    if (fd < 0) {
+        return;
+    }
+    if (buf_len + ACCESS_LOG_MAX_LINE_SIZE > ACCESS_LOG_BUFFER_SIZE) {
+        flush();
+    }
+    if (buf_len == 0) {
+        buf_since = get_monotonic_time_ms();
+        io_need_timeout(ACCESS_LOG_FLUSH_INTERVAL);
+    }
+    char* p = buf + buf_len;
+    unsigned char* ip = (unsigned char*) &(addr.s_addr);
+    p = put_str(p, "{\"client\":\"");
+    int i;
+    for (i = 0; i != 4; ++i) {
+        p = put_int(p, ip[i]);
+        *p++ = i != 3 ? '.' : '"';
+    }
+    p = put_str(p, ",\"method\":");
+    p = put_json_str(p, record->method);
+    p = put_str(p, ",\"path\":");
+    p = put_json_str(p, record->path);
+    p = put_str(p, ",\"status\":");
+    p = put_int(p, record->status);
+    p = put_str(p, ",\"bytes_in\":");
+    p = put_int(p, record->bytes_in);
+    p = put_str(p, ",\"bytes_out\":");
+    p = put_int(p, record->bytes_out);
+    p = put_str(p, is_tls ? ",\"tls\":true" : ",\"tls\":false");
+    p = put_time(p, ",\"accept_us\":", record->accepted_at);
+    p = put_time(p, ",\"headers_us\":", record->headers_at);
+    p = put_time(p, ",\"first_byte_us\":", record->first_byte_at);
+    p = put_time(p, ",\"last_byte_us\":", record->last_byte_at);
+    p = put_str(p, "}\n");
+    buf_len = p - buf;
+}
+
+void access_log_tick() {
+    if (buf_len == 0) {
+        return;
+    }
+    long long waited = get_monotonic_time_ms() - buf_since;
+    if (waited >= ACCESS_LOG_FLUSH_INTERVAL) {
+        flush();
+    } else {
+        io_need_timeout(ACCESS_LOG_FLUSH_INTERVAL - waited);
+    }
+}
+
+void access_log_cleanup() {
+    if (fd < 0) {
+        return;
+    }
+    flush();
+    close(fd);
+    fd = -1;
+}
@@ -0,0 +1,43 @@
+#ifndef __ACCESS_LOG_H__
+#define __ACCESS_LOG_H__
+
+#include <netinet/in.h>
+
+#define ACCESS_LOG_MAX_METHOD_SIZE 16
+#define ACCESS_LOG_MAX_PATH_SIZE 256
+
+// lines are written in batches, at the latest after ACCESS_LOG_FLUSH_INTERVAL milliseconds
+#define ACCESS_LOG_BUFFER_SIZE (1 << 16)
+#define ACCESS_LOG_FLUSH_INTERVAL 1000
+
+// one request as it's written to the access log, timestamps are monotonic microseconds
+struct AccessRecord {
+    int active;
+    int sampled;
+    char method[ACCESS_LOG_MAX_METHOD_SIZE];
+    char path[ACCESS_LOG_MAX_PATH_SIZE];
+    int status;
+    long long bytes_in;
+    long long bytes_out;
+    long long accepted_at;
+    long long headers_at;
+    long long first_byte_at;
+    long long last_byte_at;
+};
+
+typedef struct AccessRecord AccessRecord;
+
+// one request in every sample_rate is written, filename NULL disables the access log
+int access_log_init(const char* filename, int sample_rate);
+
+// whether the next request is to be written
+int access_log_sample();
+
+void access_log_write(const AccessRecord* record, struct in_addr addr, int is_tls);
+
+// writes the pending lines once they have waited long enough
+void access_log_tick();
+
+void access_log_cleanup();
+
+#endif
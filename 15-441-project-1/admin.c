@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "admin.h"
+#include "io.h"
+#include "utils.h"
+#include "log.h"
+
+// the longest line of the dump
+#define ADMIN_MAX_LINE_SIZE 512
+
+static const char* conn_states[] = {"RECV_REQ_HEAD", "RECV_REQ_BODY", "SEND_RES", "CGI_RECV_REQ_BODY",
+                                    "CGI_SEND_RES", "PLUGIN_RECV_REQ_BODY", "PLUGIN_SEND_RES",
+                                    "PROXY_RECV_REQ_BODY", "PROXY_SEND_RES", "CONN_CLOSE"};
+static const char* handle_states[] = {"HANDLE_RECV", "HANDLE_PROCESS", "HANDLE_SEND", "HANDLE_WAIT", "HANDLE_FAILED",
+                                      "HANDLE_FINISHED"};
+static const char* cgi_states[] = {"CGI_SPOOL", "CGI_QUEUED", "CGI_WAIT", "CGI_RECV", "CGI_SEND", "CGI_FAILED",
+                                   "CGI_ERROR", "CGI_REDIRECT", "CGI_FINISHED"};
+static const char* plugin_states[] = {"PLUGIN_RECV", "PLUGIN_SEND", "PLUGIN_FAILED", "PLUGIN_FINISHED"};
+static const char* proxy_states[] = {"PROXY_CONNECT", "PROXY_SEND", "PROXY_RECV", "PROXY_FAILED", "PROXY_ERROR",
+                                     "PROXY_FINISHED"};
+
+static char* sock_path;
+static int sock = -1;
+static int client = -1;
+// the one client is served at a time, the next ones wait in the backlog until then
+static long long client_deadline;
+
+// the next connection to dump, NULL once the whole table is in buf
+static Conn* cursor;
+
+static char buf[ADMIN_BUFFER_SIZE];
+static int buf_start;
+static int buf_end;
+
+int admin_init(const char* path) {
+    if (path == NULL) {
+        return 1;
+    }
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_(LOG_ERROR, "The admin socket path is too long: %s\n", path);
+        return 0;
+    }
+    if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        log_(LOG_ERROR, "Error creating the admin socket.\n");
+        return 0;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    // a socket left behind by a previous run
+    unlink(path);
+    if (bind(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0 || chmod(path, 0600) < 0 || listen(sock, 4) < 0) {
+        log_(LOG_ERROR, "Error listening on the admin socket %s\n", path);
+        close(sock);
+        sock = -1;
+        return 0;
+    }
+    enable_non_blocking(sock);
+    sock_path = new_str(path);
+    return 1;
+}
+
+static void dump_conn(Conn* conn, long long now) {
+    char peer[INET_ADDRSTRLEN];
+    const char* state = "-";
+    int pid = -1;
+    if (conn->handle != NULL) {
+        state = handle_states[conn->handle->state];
+    } else if (conn->cgi != NULL) {
+        state = cgi_states[conn->cgi->state];
+        pid = conn->cgi->pid;
+    } else if (conn->plugin != NULL) {
+        state = plugin_states[conn->plugin->state];
+    } else if (conn->proxy != NULL) {
+        state = proxy_states[conn->proxy->state];
+    }
+    inet_ntop(AF_INET, &(conn->addr), peer, sizeof(peer));
+    buf_end += snprintf(buf + buf_end, ADMIN_BUFFER_SIZE - buf_end,
+                        "fd=%d peer=%s tls=%d state=%s handler=%s cgi_pid=%d age_ms=%lld idle_ms=%lld "
+                        "in_buf=%d out_buf=%d\n",
+                        conn->sockfd, peer, conn->ssl != NULL, conn_states[conn->state], state, pid,
+                        (now - conn->accepted_at) / 1000, (now - conn->last_io_at) / 1000,
+                        buffer_output_size(&(conn->in_buf)), buffer_output_size(&(conn->out_buf)));
+}
+
+static void dump() {
+    long long now = get_monotonic_time_us();
+    int n;
+    for (n = 0; n != ADMIN_DUMP_BATCH && cursor != NULL; ++n) {
+        if (buf_end + ADMIN_MAX_LINE_SIZE > ADMIN_BUFFER_SIZE) {
+            // wait until the client has taken what's already formatted
+            break;
+        }
+        dump_conn(cursor, now);
+        cursor = cursor->next;
+    }
+}
+
+static void finish() {
+    close(client);
+    client = -1;
+    cursor = NULL;
+}
+
+void admin_poll(Pool* pool) {
+    if (sock < 0) {
+        return;
+    }
+    if (client < 0) {
+        client = accept(sock, NULL, NULL);
+        if (client < 0) {
+            io_need_read(sock);
+            return;
+        }
+        enable_non_blocking(client);
+        client_deadline = get_monotonic_time_ms() + ADMIN_DUMP_TIMEOUT;
+        buf_start = 0;
+        buf_end = snprintf(buf, ADMIN_BUFFER_SIZE, "connections=%d max=%d\n", pool->num_conns, pool->max_conns);
+        cursor = pool->conns;
+        log_(LOG_INFO, "Dump the connection table to the admin socket\n");
+    }
+    long long remaining = client_deadline - get_monotonic_time_ms();
+    if (remaining <= 0) {
+        log_(LOG_WARN, "Drop the admin client which doesn't read its dump\n");
+        finish();
+        io_need_read(sock);
+        return;
+    }
+    if (buf_start == buf_end) {
+        buf_start = buf_end = 0;
+    }
+    dump();
+    while (buf_start < buf_end) {
+        int ret = send(client, buf + buf_start, buf_end - buf_start, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EAGAIN) {
+                io_need_write(client);
+                io_need_timeout(remaining);
+                return;
+            }
+            finish();
+            io_need_read(sock);
+            return;
+        }
+        buf_start += ret;
+    }
+    if (cursor == NULL) {
+        finish();
+        io_need_read(sock);
+    } else {
+        // the rest of the table goes out on the next iteration
+        io_need_timeout(0);
+    }
+}
+
+void admin_forget(Conn* conn) {
+    if (cursor == conn) {
+        cursor = conn->next;
+    }
+}
+
+void admin_cleanup() {
+    if (client >= 0) {
+        finish();
+    }
+    if (sock >= 0) {
+        close(sock);
+        sock = -1;
+        unlink(sock_path);
+        free(sock_path);
+    }
+}
@@ -0,0 +1,26 @@
+#ifndef __ADMIN_H__
+#define __ADMIN_H__
+
+#include "pool.h"
+
+// connections dumped per loop iteration, so a large table never stalls the loop
+#define ADMIN_DUMP_BATCH 64
+#define ADMIN_BUFFER_SIZE (1 << 16)
+// a client taking longer than this over its dump is dropped, in milliseconds
+#define ADMIN_DUMP_TIMEOUT 5000
+
+/*
+ * A Unix domain socket dumping the connection table to whoever connects,
+ * one line per connection, e.g. with `socat - UNIX-CONNECT:<path>`.
+ */
+int admin_init(const char* path);
+
+// accepts a client or continues its dump, call it before waiting for io
+void admin_poll(Pool* pool);
+
+// called before a connection is freed, it may be where the dump continues
+void admin_forget(Conn* conn);
+
+void admin_cleanup();
+
+#endif
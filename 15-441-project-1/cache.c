@@ -0,0 +1,145 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "utils.h"
+#include "log.h"
+
+static CacheEntry* buckets[CACHE_NUM_BUCKETS];
+
+// most recently used first
+static CacheEntry* lru_head;
+static CacheEntry* lru_tail;
+
+static int max_size;
+static int size;
+
+static unsigned int hash(const char* key) {
+    unsigned int h = 5381;
+    while (*key) {
+        h = h * 33 + (unsigned char) *key++;
+    }
+    return h % CACHE_NUM_BUCKETS;
+}
+
+static void entry_free(CacheEntry* entry) {
+    free(entry->key);
+    free(entry->data);
+    free(entry);
+}
+
+static void lru_remove(CacheEntry* entry) {
+    if (entry->lru_prev != NULL) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_push(CacheEntry* entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = lru_head;
+    if (lru_head != NULL) {
+        lru_head->lru_prev = entry;
+    } else {
+        lru_tail = entry;
+    }
+    lru_head = entry;
+}
+
+// entries still being sent are freed by the last cache_release
+static void cache_unlink(CacheEntry* entry) {
+    CacheEntry** p = &buckets[hash(entry->key)];
+    while (*p != entry) {
+        p = &((*p)->hash_next);
+    }
+    *p = entry->hash_next;
+    lru_remove(entry);
+    size -= entry->len;
+    entry->linked = 0;
+    if (entry->refcount == 0) {
+        entry_free(entry);
+    }
+}
+
+void cache_init(int max) {
+    memset(buckets, 0, sizeof(buckets));
+    lru_head = lru_tail = NULL;
+    max_size = max;
+    size = 0;
+}
+
+CacheEntry* cache_lookup(const char* key) {
+    CacheEntry* entry = buckets[hash(key)];
+    while (entry != NULL && strcmp(entry->key, key)) {
+        entry = entry->hash_next;
+    }
+    if (entry == NULL) {
+        return NULL;
+    }
+    if (entry->expires_at <= get_monotonic_time_ms()) {
+        cache_unlink(entry);
+        return NULL;
+    }
+    lru_remove(entry);
+    lru_push(entry);
+    entry->refcount++;
+    return entry;
+}
+
+void cache_store(const char* key, char* data, int len, int ttl) {
+    if (len > max_size || ttl <= 0) {
+        free(data);
+        return;
+    }
+    CacheEntry* entry = buckets[hash(key)];
+    while (entry != NULL && strcmp(entry->key, key)) {
+        entry = entry->hash_next;
+    }
+    if (entry != NULL) {
+        cache_unlink(entry);
+    }
+    while (size + len > max_size && lru_tail != NULL) {
+        cache_unlink(lru_tail);
+    }
+    entry = (CacheEntry*) malloc(sizeof(CacheEntry));
+    entry->key = new_str(key);
+    entry->data = data;
+    entry->len = len;
+    entry->expires_at = get_monotonic_time_ms() + ttl;
+    entry->refcount = 0;
+    entry->linked = 1;
+    unsigned int h = hash(key);
+    entry->hash_next = buckets[h];
+    buckets[h] = entry;
+    lru_push(entry);
+    size += len;
+    log_(LOG_DEBUG, "Cache %d byte(s) for %d ms\n", len, ttl);
+}
+
+void cache_release(CacheEntry* entry) {
+    entry->refcount--;
+    if (entry->refcount == 0 && !entry->linked) {
+        entry_free(entry);
+    }
+}
+
+CacheEntry* cache_wrap(char* data, int len) {
+    CacheEntry* entry = (CacheEntry*) calloc(1, sizeof(CacheEntry));
+    entry->data = data;
+    entry->len = len;
+    entry->refcount = 1;
+    return entry;
+}
+
+void cache_cleanup() {
+    while (lru_tail != NULL) {
+        cache_unlink(lru_tail);
+    }
+}
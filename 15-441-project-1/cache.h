@@ -0,0 +1,37 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#define CACHE_NUM_BUCKETS 1024
+#define CACHE_DEFAULT_MAX_SIZE (16 << 20)
+
+// a complete response kept in memory, shared by the connections sending it
+struct CacheEntry {
+    char* key;
+    char* data;
+    int len;
+    long long expires_at;
+    int refcount;
+    int linked;
+    struct CacheEntry* hash_next;
+    struct CacheEntry* lru_prev;
+    struct CacheEntry* lru_next;
+};
+
+typedef struct CacheEntry CacheEntry;
+
+void cache_init(int max_size);
+
+// returns a referenced entry or NULL, release it with cache_release
+CacheEntry* cache_lookup(const char* key);
+
+// takes ownership of data, ttl is in milliseconds
+void cache_store(const char* key, char* data, int len, int ttl);
+
+void cache_release(CacheEntry* entry);
+
+// a referenced entry kept out of the cache, freed by its cache_release
+CacheEntry* cache_wrap(char* data, int len);
+
+void cache_cleanup();
+
+#endif
@@ -1,102 +1,734 @@
+#define _GNU_SOURCE
+
 #include <string.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <poll.h>
+#include <sys/mman.h>
 
 #include "cgi.h"
 #include "utils.h"
 #include "log.h"
 #include "io.h"
+#include "zygote.h"
+#include "cgi_pool.h"
+#include "cache.h"
+#include "flight.h"
+#include "metrics.h"
+#include "trace.h"
+
+static int spool_threshold;
+static long long spool_memory;
+
+static int coalesce;
+
+static int cache_ttl;
+static char *cache_vary[CGI_CACHE_MAX_VARY];
+static int cache_num_vary;
 
-static char *new_env(char *key, char *value) {
+// the environment is rebuilt in place for every request, nothing is allocated
+static char *envp[CGI_ENV_MAX_VARS + 1];
+static char envbuf[CGI_ENV_MAX_SIZE];
+static int env_nvars;
+static int env_len;
+
+// variables which only depend on the listening port are built once per scheme
+static char *scheme_envp[2][3];
+static char scheme_envbuf[2][64];
+static int scheme_port[2];
+
+static void env_add(const char *key, const char *value) {
     if (value == NULL) {
-        return key;
+        value = "";
+    }
+    int key_len = strlen(key);
+    int value_len = strlen(value);
+    if (env_nvars == CGI_ENV_MAX_VARS || env_len + key_len + value_len + 1 > CGI_ENV_MAX_SIZE) {
+        log_(LOG_WARN, "Drop the cgi environment variable %s due to the environment is full\n", key);
+        return;
+    }
+    char *p = envbuf + env_len;
+    memcpy(p, key, key_len);
+    memcpy(p + key_len, value, value_len + 1);
+    envp[env_nvars++] = p;
+    env_len += key_len + value_len + 1;
+}
+
+static char **scheme_env(int server_port, int is_tls) {
+    if (scheme_port[is_tls] != server_port) {
+        char *p = scheme_envbuf[is_tls];
+        scheme_envp[is_tls][0] = p;
+        p += sprintf(p, "HTTPS=%s", is_tls ? "on" : "off") + 1;
+        scheme_envp[is_tls][1] = p;
+        sprintf(p, "SERVER_PORT=%d", server_port);
+        scheme_envp[is_tls][2] = NULL;
+        scheme_port[is_tls] = server_port;
+    }
+    return scheme_envp[is_tls];
+}
+
+static char **build_env(Request *request, struct in_addr addr, int server_port, int is_tls) {
+    static char *const fixed_envp[] = {
+            "GATEWAY_INTERFACE=CGI/1.1",
+            "SCRIPT_NAME=/cgi",
+            "SERVER_PROTOCOL=HTTP/1.1",
+            "SERVER_NAME=",
+            "SERVER_SOFTWARE=Liso/1.0",
+            NULL
+    };
+    char **p;
+    env_nvars = env_len = 0;
+    for (p = (char **) fixed_envp; *p != NULL; ++p) {
+        envp[env_nvars++] = *p;
+    }
+    for (p = scheme_env(server_port, is_tls); *p != NULL; ++p) {
+        envp[env_nvars++] = *p;
+    }
+    env_add("CONTENT_LENGTH=", request_get_header(request, "Content-Length"));
+    env_add("CONTENT_TYPE=", request_get_header(request, "Content-Type"));
+    env_add("PATH_INFO=", request->abs_path + 4); // skip /cgi
+    env_add("QUERY_STRING=", request->query);
+    env_add("REMOTE_ADDR=", inet_ntoa(addr));
+    env_add("REQUEST_METHOD=", request->http_method);
+    env_add("HTTP_ACCEPT=", request_get_header(request, "Accept"));
+    env_add("HTTP_REFERER=", request_get_header(request, "Referer"));
+    env_add("HTTP_ACCEPT_ENCODING=", request_get_header(request, "Accept-Encoding"));
+    env_add("HTTP_ACCEPT_LANGUAGE=", request_get_header(request, "Accept-Language"));
+    env_add("HTTP_ACCEPT_CHARSET=", request_get_header(request, "Accept-Charset"));
+    env_add("HTTP_COOKIE=", request_get_header(request, "Cookie"));
+    env_add("HTTP_USER_AGENT=", request_get_header(request, "User-Agent"));
+    env_add("HTTP_CONNECTION=", request_connection_close(request) ? "close" : "keep-alive");
+    env_add("HTTP_HOST=", request_get_header(request, "Host"));
+    envp[env_nvars] = NULL;
+    return envp;
+}
+
+/*
+ * Start the script with infd as its stdin and outfd as its stdout. posix_spawn
+ * doesn't copy the page tables of lisod, so its cost doesn't grow with the
+ * memory held by the server. Returns 0 or an error number, the pid is 0 when
+ * the zygote forks the script, proc gets it once the zygote replies.
+ */
+static int spawn_script(char *script_path, char **env, int infd, int outfd, CgiProc *proc, pid_t *pid) {
+    // prefer the pre-warmed zygote
+    *pid = 0;
+    if (zygote_spawn(env, infd, outfd, proc)) {
+        return 0;
+    }
+    posix_spawn_file_actions_t actions;
+    if (posix_spawn_file_actions_init(&actions) != 0) {
+        return ENOMEM;
+    }
+    // the pipes are close-on-exec, dup2 clears the flag on stdin and stdout
+    posix_spawn_file_actions_adddup2(&actions, infd, STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, outfd, STDOUT_FILENO);
+    char *argv[] = {script_path, NULL};
+    int err = posix_spawn(pid, script_path, &actions, NULL, argv, env);
+    posix_spawn_file_actions_destroy(&actions);
+    return err;
+}
+
+/*
+ * A non-blocking splice fails with EAGAIN when either side isn't ready,
+ * only wait for the side which is actually blocked.
+ */
+static void splice_need_io(int infd, int outfd) {
+    struct pollfd fds[2] = {{infd, POLLIN, 0},
+                            {outfd, POLLOUT, 0}};
+    poll(fds, 2, 0);
+    int in_ready = fds[0].revents != 0;
+    int out_ready = fds[1].revents != 0;
+    if (!in_ready || out_ready) {
+        io_need_read(infd);
+    }
+    if (!out_ready || in_ready) {
+        io_need_write(outfd);
+    }
+}
+
+// waiters of a failed leader run the script themselves if nothing has been sent yet
+static void leave_flight(Cgi *cgi, int ok) {
+    if (cgi->flight != NULL && cgi->flight_leader) {
+        flight_finish(cgi->flight, ok);
+    }
+}
+
+static void cgi_fail(Cgi *cgi, StatusCode error) {
+    leave_flight(cgi, 0);
+    cgi->state = CGI_ERROR;
+    cgi->error = error;
+    cgi->last_req = 1;
+}
+
+static StatusCode errno_to_status(int err) {
+    switch (err) {
+        case EAGAIN:
+        case ENOMEM:
+        case EMFILE:
+        case ENFILE:
+            return SERVICE_UNAVAILABLE;
+        default:
+            return INTERNAL_SERVER_ERROR;
     }
-    char *p = malloc(strlen(key) + strlen(value) + 1);
-    strcpy(p, key);
-    strcat(p, value);
-    return p;
+}
+
+/*
+ * The key of a shareable request is made of the method, the path, the query,
+ * the connection token (echoed by scripts) and the configured headers.
+ * Returns NULL if the response can't be shared with other requests.
+ */
+static char *request_key(Request *request) {
+    if (request->content_length != 0
+        || (strcmp(request->http_method, "GET") && strcmp(request->http_method, "HEAD"))
+        || request_get_header(request, "Authorization") != NULL) {
+        return NULL;
+    }
+    int len = strlen(request->http_method) + strlen(request->abs_path) + strlen(request->query) + 16;
+    int i;
+    for (i = 0; i != cache_num_vary; ++i) {
+        char *value = request_get_header(request, cache_vary[i]);
+        len += (value != NULL ? strlen(value) : 0) + 1;
+    }
+    char *key = (char *) malloc(len);
+    char *p = key + sprintf(key, "%s %s?%s\n%d", request->http_method, request->abs_path, request->query,
+                            request_connection_close(request));
+    for (i = 0; i != cache_num_vary; ++i) {
+        char *value = request_get_header(request, cache_vary[i]);
+        p += sprintf(p, "\n%s", value != NULL ? value : "");
+    }
+    return key;
+}
+
+static char *cache_key(Request *request) {
+    return cache_ttl > 0 ? request_key(request) : NULL;
+}
+
+void cgi_set_cache(int ttl, const char *vary) {
+    cache_ttl = ttl;
+    cache_num_vary = 0;
+    if (vary == NULL) {
+        return;
+    }
+    char *headers = new_str(vary);
+    char *saveptr;
+    char *token;
+    for (token = strtok_r(headers, ",", &saveptr); token != NULL && cache_num_vary != CGI_CACHE_MAX_VARY;
+         token = strtok_r(NULL, ",", &saveptr)) {
+        cache_vary[cache_num_vary++] = new_str(token);
+    }
+    free(headers);
+}
+
+CacheEntry *cgi_cache_lookup(Request *request) {
+    char *pragma = request_get_header(request, "Pragma");
+    char *cache_control = request_get_header(request, "Cache-Control");
+    if ((pragma != NULL && strcasestr(pragma, "no-cache") != NULL)
+        || (cache_control != NULL && strcasestr(cache_control, "no-cache") != NULL)) {
+        return NULL;
+    }
+    char *key = cache_key(request);
+    if (key == NULL) {
+        return NULL;
+    }
+    CacheEntry *entry = cache_lookup(key);
+    free(key);
+    return entry;
+}
+
+void cgi_set_coalesce(int enabled) {
+    coalesce = enabled;
 }
 
 int cgi_can_handle(Request *request) {
     return strstr(request->abs_path, "/cgi/") == request->abs_path && request->content_length >= 0;
 }
 
+static void cgi_start(Cgi *cgi) {
+    Request *request = cgi->request;
+    // a spooled body is already complete, the script reads it from the spool file
+    cgi->state = request->content_length == 0 || cgi->spoolfd >= 0 ? CGI_SEND : CGI_RECV;
+    int stdin_pipe[2] = {-1, -1};
+    int stdout_pipe[2];
+    if (cgi->spoolfd < 0 && pipe2(stdin_pipe, O_CLOEXEC) < 0) {
+        cgi_fail(cgi, errno_to_status(errno));
+        log_(LOG_ERROR, "Error piping for stdin.\n");
+        return;
+    }
+    if (pipe2(stdout_pipe, O_CLOEXEC) < 0) {
+        cgi_fail(cgi, errno_to_status(errno));
+        if (stdin_pipe[0] >= 0) {
+            close(stdin_pipe[0]);
+            close(stdin_pipe[1]);
+        }
+        log_(LOG_ERROR, "Error piping for stdout.\n");
+        return;
+    }
+    pid_t pid;
+    CgiProc *proc = cgi_pool_add_proc();
+    int err = spawn_script(cgi->script_path, build_env(request, cgi->addr, cgi->server_port, cgi->is_tls),
+                           cgi->spoolfd >= 0 ? cgi->spoolfd : stdin_pipe[0], stdout_pipe[1], proc, &pid);
+    if (err != 0 || pid > 0) {
+        cgi_pool_set_pid(proc, err != 0 ? -1 : pid);
+    } else {
+        proc->cgi = cgi;
+        cgi->proc = proc;
+    }
+    close(stdout_pipe[1]);
+    if (cgi->spoolfd >= 0) {
+        close(cgi->spoolfd);
+        cgi->spoolfd = -1;
+    } else {
+        close(stdin_pipe[0]);
+    }
+    if (err != 0) {
+        cgi_fail(cgi, errno_to_status(err));
+        if (stdin_pipe[1] >= 0) {
+            close(stdin_pipe[1]);
+        }
+        close(stdout_pipe[0]);
+        log_(LOG_ERROR, "Error spawning the cgi process, script_path = %s: %s\n", cgi->script_path, strerror(err));
+        return;
+    }
+    metrics_cgi_spawned();
+    cgi->pid = pid;
+    cgi->infd = stdin_pipe[1];
+    cgi->outfd = stdout_pipe[0];
+    if (cgi->infd >= 0) {
+        enable_non_blocking(cgi->infd);
+    }
+    enable_non_blocking(cgi->outfd);
+    log_(LOG_DEBUG, "Create a cgi process, pid = %d, script_path = %s\n", pid, cgi->script_path);
+}
+
+static int open_spool(Cgi *cgi) {
+    int size = cgi->request->content_length;
+    int fd = -1;
+    if (spool_memory + size <= CGI_SPOOL_MAX_MEMORY) {
+        fd = memfd_create("lisod-cgi-body", MFD_CLOEXEC);
+    }
+    if (fd >= 0) {
+        cgi->spool_memory = size;
+        spool_memory += size;
+    } else {
+        // an unnamed temporary file works as well where memfd isn't available or the memory is taken
+        fd = open(CGI_SPOOL_DIR, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    }
+    return fd;
+}
+
+void cgi_set_spool_threshold(int threshold) {
+    spool_threshold = threshold;
+}
+
 void cgi_init(Cgi *cgi, char *script_path,
               Request *request, struct in_addr addr,
               int server_port, int is_tls) {
+    cgi->pid = -1;
+    cgi->proc = NULL;
     cgi->infd = cgi->outfd = -1;
+    cgi->script_path = script_path;
     cgi->request = request;
+    cgi->addr = addr;
+    cgi->server_port = server_port;
+    cgi->is_tls = is_tls;
     cgi->req_content_length = 0;
-    cgi->state = request->content_length == 0 ? CGI_SEND : CGI_RECV;
-    int stdin_pipe[2];
-    int stdout_pipe[2];
-    if (pipe(stdin_pipe) < 0) {
-        cgi->state = CGI_FAILED;
-        log_(LOG_ERROR, "Error piping for stdin.\n");
+    cgi->last_req = request_connection_close(request);
+    cgi->error = OK;
+    cgi->use_splice = !is_tls;
+    cgi->head_len = cgi->head_sent = 0;
+    cgi->head_done = cgi->eof = 0;
+    cgi->status_code = 0;
+    cgi->head_end = 0;
+    cgi->res_len = 0;
+    cgi->res_content_length = -1;
+    cgi->redirect_path = NULL;
+    cgi->cache_key = cache_key(request);
+    cgi->cache_ttl = cache_ttl;
+    cgi->capture = NULL;
+    cgi->capture_len = cgi->capture_cap = 0;
+    cgi->queue_prev = cgi->queue_next = NULL;
+    cgi->spoolfd = -1;
+    cgi->spool_memory = 0;
+    cgi->flight = NULL;
+    cgi->flight_leader = 0;
+    cgi->flight_offset = 0;
+    char *key = coalesce ? request_key(request) : NULL;
+    if (key != NULL) {
+        cgi->flight = flight_join(key);
+        if (cgi->flight != NULL) {
+            // an identical request is running, its response is copied as it arrives
+            free(key);
+            cgi->state = CGI_WAIT;
+            return;
+        }
+        cgi->flight = flight_begin(key);
+        cgi->flight_leader = 1;
+        cgi->use_splice = 0;
+        free(key);
+    }
+    if (spool_threshold > 0 && request->content_length > spool_threshold) {
+        // large bodies are received in full before a process is taken
+        cgi->spoolfd = open_spool(cgi);
+        if (cgi->spoolfd >= 0) {
+            cgi->state = CGI_SPOOL;
+            return;
+        }
+        log_(LOG_WARN, "Error creating the spool file for the request body, pipe it instead\n");
+    }
+    // the process is started by cgi_schedule once a slot is free
+    cgi->state = CGI_QUEUED;
+    cgi_pool_enqueue(cgi);
+}
+
+void cgi_spool(Cgi *cgi, Buffer *buf) {
+    if (cgi->state != CGI_SPOOL) {
+        log_(LOG_WARN, "cgi_spool is called when cgi state isn't CGI_SPOOL\n");
         return;
     }
-    if (pipe(stdout_pipe) < 0) {
-        close(stdin_pipe[0]);
-        close(stdin_pipe[1]);
-        cgi->state = CGI_FAILED;
-        log_(LOG_ERROR, "Error piping for stdout.\n");
+    int len = min(buffer_output_size(buf), cgi->request->content_length - cgi->req_content_length);
+    int writeret = write(cgi->spoolfd, buffer_output_ptr(buf), len);
+    if (writeret < 0) {
+        close(cgi->spoolfd);
+        cgi->spoolfd = -1;
+        cgi_fail(cgi, errno_to_status(errno));
+        log_(LOG_ERROR, "Error writing the request body to the spool file\n");
         return;
     }
-    pid_t pid = fork();
-    if (pid < 0) {
-        exit(EXIT_FAILURE);
+    buffer_output(buf, writeret);
+    cgi->req_content_length += writeret;
+    if (cgi->req_content_length == cgi->request->content_length) {
+        lseek(cgi->spoolfd, 0, SEEK_SET);
+        log_(LOG_DEBUG, "Spool a request body of %d byte(s)\n", cgi->req_content_length);
+        cgi->state = CGI_QUEUED;
+        cgi_pool_enqueue(cgi);
     }
-    if (pid == 0) {
-        close(stdout_pipe[0]);
-        close(stdin_pipe[1]);
-        dup2(stdout_pipe[1], fileno(stdout));
-        dup2(stdin_pipe[0], fileno(stdin));
-        char *argv[] = {script_path, NULL};
-        char *port_str;
-        asprintf(&port_str, "%d", server_port);
-        char *envp[] = {
-                is_tls ? "HTTPS=on" : "HTTPS=off",
-                new_env("CONTENT_LENGTH=", request_get_header(request, "Content-Length")),
-                new_env("CONTENT_TYPE=", request_get_header(request, "Content-Type")),
-                "GATEWAY_INTERFACE=CGI/1.1",
-                new_env("PATH_INFO=", request->abs_path + 4), // skip /cgi
-                new_env("QUERY_STRING=", request->query),
-                new_env("REMOTE_ADDR=", inet_ntoa(addr)),
-                new_env("REQUEST_METHOD=", request->http_method),
-                "SCRIPT_NAME=/cgi",
-                new_env("SERVER_PORT=", port_str),
-                "SERVER_PROTOCOL=HTTP/1.1",
-                "SERVER_NAME=",
-                "SERVER_SOFTWARE=Liso/1.0",
-                new_env("HTTP_ACCEPT=", request_get_header(request, "Accept")),
-                new_env("HTTP_REFERER=", request_get_header(request, "Referer")),
-                new_env("HTTP_ACCEPT_ENCODING=", request_get_header(request, "Accept-Encoding")),
-                new_env("HTTP_ACCEPT_LANGUAGE=", request_get_header(request, "Accept-Language")),
-                new_env("HTTP_ACCEPT_CHARSET=", request_get_header(request, "Accept-Charset")),
-                new_env("HTTP_COOKIE=", request_get_header(request, "Cookie")),
-                new_env("HTTP_USER_AGENT=", request_get_header(request, "User-Agent")),
-                new_env("HTTP_CONNECTION=", request_connection_close(request) ? "close" : "keep-alive"),
-                new_env("HTTP_HOST=", request_get_header(request, "Host")),
-                NULL
-        };
-        // successful execve doesn't return
-        execve(script_path, argv, envp);
-        exit(EXIT_FAILURE);
-    } else if (pid > 0) {
-        close(stdout_pipe[1]);
-        close(stdin_pipe[0]);
-        cgi->infd = stdin_pipe[1];
-        cgi->outfd = stdout_pipe[0];
-        enable_non_blocking(cgi->infd);
-        enable_non_blocking(cgi->outfd);
-        log_(LOG_DEBUG, "Create a cgi process, pid = %d, script_path = %s\n", pid, script_path);
+}
+
+int cgi_schedule(Cgi *cgi) {
+    if (cgi->state != CGI_QUEUED) {
+        return 1;
+    }
+    if (cgi_pool_can_start(cgi)) {
+        cgi_pool_dequeue(cgi);
+        cgi_start(cgi);
+        return 1;
+    }
+    if (cgi_pool_is_expired(cgi)) {
+        cgi_pool_dequeue(cgi);
+        cgi_fail(cgi, SERVICE_UNAVAILABLE);
+        log_(LOG_WARN, "Reject the cgi request which waits too long for a cgi process\n");
+        return 1;
+    }
+    return 0;
+}
+
+void cgi_spawned(Cgi *cgi, pid_t pid) {
+    cgi->proc = NULL;
+    if (pid > 0) {
+        cgi->pid = pid;
+        return;
+    }
+    log_(LOG_ERROR, "Error spawning the cgi process through the zygote, script_path = %s\n", cgi->script_path);
+    // nothing has come from the script, answer on its behalf unless the empty output has been noticed already
+    if (cgi->state == CGI_RECV || (cgi->state == CGI_SEND && cgi->head_len == 0)) {
+        cgi_fail(cgi, SERVICE_UNAVAILABLE);
+    }
+}
+
+static char *find_head_end(char *head, int len) {
+    int i;
+    for (i = 0; i < len; ++i) {
+        if (head[i] != '\n') {
+            continue;
+        }
+        if (i + 1 < len && head[i + 1] == '\n') {
+            return head + i + 2;
+        }
+        if (i + 2 < len && head[i + 1] == '\r' && head[i + 2] == '\n') {
+            return head + i + 3;
+        }
+    }
+    return NULL;
+}
+
+// only plain paths inside the www folder can be served on behalf of the script
+static int is_safe_path(const char *path) {
+    return path[0] == '/' && strstr(path, "/../") == NULL
+           && (strlen(path) < 3 || strcmp(path + strlen(path) - 3, "/..") != 0);
+}
+
+static int header_is(const char *name, int name_len, const char *expected) {
+    return name_len == strlen(expected) && !strncasecmp(name, expected, name_len);
+}
+
+static int vary_is_keyed(const char *value, int value_len) {
+    char *vary = new_strn(value, value_len);
+    vary[value_len] = 0;
+    int keyed = 1;
+    char *saveptr;
+    char *token;
+    for (token = strtok_r(vary, ", ", &saveptr); token != NULL; token = strtok_r(NULL, ", ", &saveptr)) {
+        int i;
+        for (i = 0; i != cache_num_vary && strcasecmp(token, cache_vary[i]); ++i);
+        keyed = keyed && i != cache_num_vary;
+    }
+    free(vary);
+    return keyed;
+}
+
+static void inspect_cache_control(Cgi *cgi, const char *value, int value_len) {
+    char *cache_control = new_strn(value, value_len);
+    cache_control[value_len] = 0;
+    char *saveptr;
+    char *token;
+    int max_age = -1;
+    for (token = strtok_r(cache_control, ", ", &saveptr); token != NULL; token = strtok_r(NULL, ", ", &saveptr)) {
+        if (!strcasecmp(token, "no-store") || !strcasecmp(token, "no-cache") || !strcasecmp(token, "private")) {
+            cgi->cache_ttl = -1;
+        } else if (!strncasecmp(token, "s-maxage=", 9)) {
+            max_age = atoi(token + 9);
+        } else if (!strncasecmp(token, "max-age=", 8) && max_age < 0) {
+            max_age = atoi(token + 8);
+        }
+    }
+    if (max_age >= 0 && cgi->cache_ttl >= 0) {
+        cgi->cache_ttl = max_age * 1000 < cgi->cache_ttl ? max_age * 1000 : cgi->cache_ttl;
+    }
+    free(cache_control);
+}
+
+static void inspect_header(Cgi *cgi, const char *name, int name_len, const char *value, int value_len) {
+    if (header_is(name, name_len, "X-Sendfile") || header_is(name, name_len, "X-Accel-Redirect")) {
+        free(cgi->redirect_path);
+        cgi->redirect_path = new_strn(value, value_len);
+        cgi->redirect_path[value_len] = 0;
+    } else if (header_is(name, name_len, "Content-Length")) {
+        cgi->res_content_length = atoi(value);
+    } else if (header_is(name, name_len, "Cache-Control")) {
+        inspect_cache_control(cgi, value, value_len);
+    } else if (header_is(name, name_len, "Set-Cookie")
+               || (header_is(name, name_len, "Vary") && !vary_is_keyed(value, value_len))) {
+        // responses depending on more than the cache key are never shared
+        cgi->cache_ttl = -1;
+    }
+}
+
+static void inspect_head(Cgi *cgi, char *end) {
+    char *line = cgi->head;
+    if (!strncmp(line, "HTTP/", 5)) {
+        char *sp = memchr(line, ' ', end - line);
+        if (sp != NULL) {
+            cgi->status_code = atoi(sp + 1);
+        }
+    }
+    while (line < end) {
+        char *eol = memchr(line, '\n', end - line);
+        if (eol == NULL) {
+            break;
+        }
+        char *colon = memchr(line, ':', eol - line);
+        if (colon != NULL) {
+            char *value = colon + 1;
+            char *value_end = eol;
+            while (value < value_end && (*value == ' ' || *value == '\t')) {
+                ++value;
+            }
+            while (value_end > value && (value_end[-1] == '\r' || value_end[-1] == ' ' || value_end[-1] == '\t')) {
+                --value_end;
+            }
+            inspect_header(cgi, line, colon - line, value, value_end - value);
+        }
+        line = eol + 1;
+    }
+}
+
+static void capture_append(Cgi *cgi, const char *data, int len) {
+    if (cgi->capture == NULL) {
+        return;
+    }
+    if (cgi->capture_len + len > CGI_CACHE_MAX_ENTRY_SIZE) {
+        // too large to be worth caching
+        free(cgi->capture);
+        cgi->capture = NULL;
+        return;
+    }
+    if (cgi->capture_len + len > cgi->capture_cap) {
+        cgi->capture_cap = max(cgi->capture_cap * 2, cgi->capture_len + len);
+        cgi->capture = (char *) realloc(cgi->capture, cgi->capture_cap);
+    }
+    memcpy(cgi->capture + cgi->capture_len, data, len);
+    cgi->capture_len += len;
+}
+
+// a script killed halfway must not leave a truncated response behind, only the cache requires a Content-Length
+static int response_is_complete(Cgi *cgi) {
+    return cgi->res_content_length < 0 || !strcmp(cgi->request->http_method, "HEAD")
+           || cgi->res_len - cgi->head_end == cgi->res_content_length;
+}
+
+static void capture_commit(Cgi *cgi) {
+    if (cgi->capture == NULL) {
+        return;
+    }
+    if (!response_is_complete(cgi)) {
+        free(cgi->capture);
+        cgi->capture = NULL;
+        return;
+    }
+    cache_store(cgi->cache_key, cgi->capture, cgi->capture_len, cgi->cache_ttl);
+    cgi->capture = NULL;
+}
+
+// every byte relayed to the client goes through here
+static void publish(Cgi *cgi, const char *data, int len) {
+    cgi->res_len += len;
+    capture_append(cgi, data, len);
+    if (cgi->flight_leader && !flight_append(cgi->flight, data, len)) {
+        // nothing is buffered for requests which may join later, splice the rest
+        flight_release(cgi->flight);
+        cgi->flight = NULL;
+        cgi->flight_leader = 0;
+        cgi->use_splice = !cgi->is_tls;
+    }
+}
+
+static void publish_finish(Cgi *cgi) {
+    capture_commit(cgi);
+    leave_flight(cgi, response_is_complete(cgi));
+    cgi->state = CGI_FINISHED;
+}
+
+/*
+ * Read the response head of the script into cgi->head. Once it's complete it
+ * is inspected, and either the response is redirected to a static file or
+ * the head is passed on to the client.
+ */
+static int cgi_read_head(Cgi *cgi) {
+    if (io_wait_read(cgi->outfd)) {
+        return 0;
+    }
+    TRACE_BEGIN(span);
+    int readret = read(cgi->outfd, cgi->head + cgi->head_len, CGI_HEAD_MAX_SIZE - cgi->head_len);
+    TRACE_END(span, "cgi_read", cgi->outfd);
+    if (readret < 0) {
+        switch (errno) {
+            case EAGAIN:
+                io_need_read(cgi->outfd);
+                return 0;
+            default:
+                cgi->state = CGI_FAILED;
+                return 1;
+        }
+    }
+    cgi->head_len += readret;
+    cgi->eof = readret == 0;
+    if (cgi->eof && cgi->head_len == 0) {
+        // the script died without a word, an empty response would leave a keep-alive client waiting
+        log_(LOG_WARN, "The cgi script exits without any output, script_path = %s\n", cgi->script_path);
+        cgi_fail(cgi, BAD_GATEWAY);
+        return 1;
+    }
+    char *end = find_head_end(cgi->head, cgi->head_len);
+    if (end == NULL && !cgi->eof && cgi->head_len < CGI_HEAD_MAX_SIZE) {
+        return 1;
+    }
+    // a head which doesn't fit is passed through as it is
+    cgi->head_done = 1;
+    if (end != NULL) {
+        cgi->head_end = end - cgi->head;
+        inspect_head(cgi, end);
+    }
+    // without a Content-Length, a script killed or crashing halfway can't be told from a complete one
+    if (cgi->cache_key != NULL && end != NULL && cgi->status_code == OK
+        && cgi->cache_ttl > 0 && cgi->redirect_path == NULL
+        && (cgi->res_content_length >= 0 || !strcmp(cgi->request->http_method, "HEAD"))) {
+        // keep a copy of the whole response, it doesn't go through splice then
+        cgi->capture_cap = CGI_HEAD_MAX_SIZE * 2;
+        cgi->capture = (char *) malloc(cgi->capture_cap);
+    }
+    if (end == NULL || cgi->cache_ttl < 0 || cgi->redirect_path != NULL) {
+        leave_flight(cgi, 0);
+    }
+    publish(cgi, cgi->head, cgi->head_len);
+    if (cgi->redirect_path != NULL) {
+        if (!is_safe_path(cgi->redirect_path)) {
+            log_(LOG_WARN, "Refuse to send %s on behalf of the cgi script\n", cgi->redirect_path);
+            cgi_fail(cgi, INTERNAL_SERVER_ERROR);
+        } else {
+            log_(LOG_DEBUG, "The cgi script redirects the response to %s\n", cgi->redirect_path);
+            cgi->state = CGI_REDIRECT;
+        }
+        // the rest of the output is discarded
+        close(cgi->outfd);
+        cgi->outfd = -1;
+    }
+    return 1;
+}
+
+static void cgi_flush_head(Cgi *cgi, Buffer *buf) {
+    while (!buffer_is_full(buf) && cgi->head_sent < cgi->head_len) {
+        int len = min(buffer_input_size(buf), cgi->head_len - cgi->head_sent);
+        memcpy(buffer_input_ptr(buf), cgi->head + cgi->head_sent, len);
+        buffer_input(buf, len);
+        cgi->head_sent += len;
+    }
+    if (cgi->head_sent == cgi->head_len && cgi->eof) {
+        publish_finish(cgi);
+    }
+}
+
+static int cgi_read_flight(Cgi *cgi, Buffer *buf) {
+    Flight *flight = cgi->flight;
+    int len = min(buffer_input_size(buf), flight->len - cgi->flight_offset);
+    if (len > 0) {
+        memcpy(buffer_input_ptr(buf), flight->data + cgi->flight_offset, len);
+        buffer_input(buf, len);
+        cgi->flight_offset += len;
+        return 1;
+    }
+    switch (flight->state) {
+        case FLIGHT_RUNNING:
+            // woken up by the leader
+            return 0;
+        case FLIGHT_DONE:
+            cgi->state = CGI_FINISHED;
+            return 1;
+        default:
+            flight_release(flight);
+            cgi->flight = NULL;
+            if (cgi->flight_offset > 0) {
+                cgi->state = CGI_FAILED;
+                return 1;
+            }
+            log_(LOG_DEBUG, "The response can't be shared, run the cgi script for the waiter\n");
+            cgi->state = CGI_QUEUED;
+            cgi_pool_enqueue(cgi);
+            return 1;
     }
 }
 
 int cgi_read(Cgi *cgi, Buffer *buf) {
+    if (cgi->state == CGI_ERROR) {
+        // the script never ran, answer with the error on its behalf
+        if (!buffer_is_empty(buf)) {
+            return 0;
+        }
+        Response *response = response_error(cgi->error);
+        response_add_header(response, "Connection", "close");
+        buffer_init_by_response(buf, response);
+        response_destroy(response);
+        free(response);
+        cgi->state = CGI_FINISHED;
+        return 1;
+    }
+    if (cgi->state == CGI_WAIT) {
+        return cgi_read_flight(cgi, buf);
+    }
     if (cgi->state != CGI_SEND) {
         log_(LOG_WARN, "cgi_read is called when cgi state isn't CGI_SEND\n");
         return 1;
@@ -105,10 +737,19 @@ int cgi_read(Cgi *cgi, Buffer *buf) {
         log_(LOG_WARN, "cgi_read is called when the buffer is full\n");
         return 1;
     }
+    if (!cgi->head_done) {
+        return cgi_read_head(cgi);
+    }
+    if (cgi->head_sent < cgi->head_len || cgi->eof) {
+        cgi_flush_head(cgi, buf);
+        return 1;
+    }
     if (io_wait_read(cgi->outfd)) {
         return 0;
     }
+    TRACE_BEGIN(span);
     int readret = read(cgi->outfd, buffer_input_ptr(buf), buffer_input_size(buf));
+    TRACE_END(span, "cgi_read", cgi->outfd);
     if (readret < 0) {
         switch (errno) {
             case EAGAIN:
@@ -119,9 +760,10 @@ int cgi_read(Cgi *cgi, Buffer *buf) {
                 return 1;
         }
     } else if (readret == 0) {
-        cgi->state = CGI_FINISHED;
+        publish_finish(cgi);
         return 1;
     }
+    publish(cgi, buffer_input_ptr(buf), readret);
     buffer_input(buf, readret);
     log_(LOG_DEBUG, "Read %d byte(s) from cgi\n", readret);
     return 1;
@@ -140,7 +782,9 @@ int cgi_write(Cgi *cgi, Buffer *buf) {
         return 0;
     }
     int len = min(buffer_output_size(buf), cgi->request->content_length - cgi->req_content_length);
+    TRACE_BEGIN(span);
     int writeret = write(cgi->infd, buffer_output_ptr(buf), len);
+    TRACE_END(span, "cgi_write", cgi->infd);
     if (writeret < 0) {
         switch (errno) {
             case EAGAIN:
@@ -153,7 +797,110 @@ int cgi_write(Cgi *cgi, Buffer *buf) {
     }
     buffer_output(buf, writeret);
     log_(LOG_DEBUG, "Write %d byte(s) to cgi\n", writeret);
-    cgi->req_content_length += len;
+    cgi->req_content_length += writeret;
+    if (cgi->req_content_length == cgi->request->content_length) {
+        cgi->state = CGI_SEND;
+    }
+    return 1;
+}
+
+// keeps the order of the list, the redirected request has no body to describe
+static void copy_headers(Request *request, RequestHeader *header) {
+    if (header == NULL) {
+        return;
+    }
+    copy_headers(request, header->next);
+    if (strcasecmp(header->header_name, "Content-Length") && strcasecmp(header->header_name, "Content-Type")
+        && strcasecmp(header->header_name, "Transfer-Encoding")) {
+        request_add_header(request, header->header_name, header->header_value);
+    }
+}
+
+Request *cgi_redirect_request(Cgi *cgi) {
+    Request *request = (Request *) malloc(sizeof(Request));
+    request_init(request);
+    request->http_version = new_str(cgi->request->http_version);
+    request->http_method = new_str(strcmp(cgi->request->http_method, "HEAD") ? "GET" : "HEAD");
+    char *query = strchr(cgi->redirect_path, '?');
+    if (query != NULL) {
+        *query = 0;
+    }
+    request->abs_path = new_str(cgi->redirect_path);
+    request->query = new_str(query != NULL ? query + 1 : "");
+    copy_headers(request, cgi->request->headers);
+    return request;
+}
+
+int cgi_can_splice(Cgi *cgi) {
+    return cgi->use_splice && cgi->state == CGI_SEND && cgi->head_done && cgi->capture == NULL && cgi->flight == NULL
+           && cgi->head_sent == cgi->head_len && !cgi->eof;
+}
+
+int cgi_splice_read(Cgi *cgi, int sockfd, long long *count) {
+    if (cgi->state != CGI_SEND) {
+        log_(LOG_WARN, "cgi_splice_read is called when cgi state isn't CGI_SEND\n");
+        return 1;
+    }
+    if (io_wait_read(cgi->outfd) || io_wait_write(sockfd)) {
+        return 0;
+    }
+    TRACE_BEGIN(span);
+    int ret = splice(cgi->outfd, NULL, sockfd, NULL, CGI_SPLICE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    TRACE_END(span, "cgi_splice_read", cgi->outfd);
+    if (ret < 0) {
+        switch (errno) {
+            case EAGAIN:
+                splice_need_io(cgi->outfd, sockfd);
+                return 0;
+            case EINVAL:
+                // splice isn't supported for this pair, keep using the buffer
+                cgi->use_splice = 0;
+                return 1;
+            default:
+                cgi->state = CGI_FAILED;
+                return 1;
+        }
+    } else if (ret == 0) {
+        cgi->state = CGI_FINISHED;
+        return 1;
+    }
+    *count += ret;
+    log_(LOG_DEBUG, "Splice %d byte(s) from cgi\n", ret);
+    return 1;
+}
+
+int cgi_splice_write(Cgi *cgi, int sockfd, long long *count) {
+    if (cgi->state != CGI_RECV) {
+        log_(LOG_WARN, "cgi_splice_write is called when cgi state isn't CGI_RECV\n");
+        return 1;
+    }
+    if (io_wait_read(sockfd) || io_wait_write(cgi->infd)) {
+        return 0;
+    }
+    int len = min(CGI_SPLICE_SIZE, cgi->request->content_length - cgi->req_content_length);
+    TRACE_BEGIN(span);
+    int ret = splice(sockfd, NULL, cgi->infd, NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    TRACE_END(span, "cgi_splice_write", cgi->infd);
+    if (ret < 0) {
+        switch (errno) {
+            case EAGAIN:
+                splice_need_io(sockfd, cgi->infd);
+                return 0;
+            case EINVAL:
+                cgi->use_splice = 0;
+                return 1;
+            default:
+                cgi->state = CGI_FAILED;
+                return 1;
+        }
+    } else if (ret == 0) {
+        // the client closed the connection before sending the whole body
+        cgi->state = CGI_FAILED;
+        return 1;
+    }
+    *count += ret;
+    log_(LOG_DEBUG, "Splice %d byte(s) to cgi\n", ret);
+    cgi->req_content_length += ret;
     if (cgi->req_content_length == cgi->request->content_length) {
         cgi->state = CGI_SEND;
     }
@@ -161,12 +908,27 @@ int cgi_write(Cgi *cgi, Buffer *buf) {
 }
 
 void cgi_destroy(Cgi *cgi) {
+    cgi_pool_dequeue(cgi);
+    if (cgi->proc != NULL) {
+        cgi->proc->cgi = NULL;
+    }
+    if (cgi->flight != NULL) {
+        leave_flight(cgi, 0);
+        flight_release(cgi->flight);
+    }
+    if (cgi->spoolfd >= 0) {
+        close(cgi->spoolfd);
+    }
+    spool_memory -= cgi->spool_memory;
     if (cgi->infd >= 0) {
         close(cgi->infd);
     }
     if (cgi->outfd >= 0) {
         close(cgi->outfd);
     }
+    free(cgi->redirect_path);
+    free(cgi->cache_key);
+    free(cgi->capture);
     request_destroy(cgi->request);
     free(cgi->request);
     log_(LOG_DEBUG, "Cancel the cgi process\n");
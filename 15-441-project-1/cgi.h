@@ -1,40 +1,129 @@
 #ifndef __CGI_H__
 #define __CGI_H__
 
+#include <sys/types.h>
 #include <netinet/ip.h>
 
 #include "http.h"
 #include "buffer.h"
+#include "cache.h"
+#include "flight.h"
+
+#define CGI_SPLICE_SIZE (1 << 16)
+
+#define CGI_SPOOL_DIR "/tmp"
+// past this many bytes of spooled bodies in memory, new ones are spooled to CGI_SPOOL_DIR
+#define CGI_SPOOL_MAX_MEMORY (64 << 20)
+
+#define CGI_HEAD_MAX_SIZE BUFFER_MAX_SIZE
+
+#define CGI_CACHE_MAX_VARY 8
+#define CGI_CACHE_MAX_ENTRY_SIZE (1 << 20)
+#define CGI_CACHE_DEFAULT_VARY "Cookie"
+
+#define CGI_ENV_MAX_VARS 32
+#define CGI_ENV_MAX_SIZE (HTTP_HEADER_MAX_SIZE + 1024)
 
 enum CgiState {
+    CGI_SPOOL,
+    CGI_QUEUED,
+    CGI_WAIT,
     CGI_RECV,
     CGI_SEND,
     CGI_FAILED,
+    CGI_ERROR,
+    CGI_REDIRECT,
     CGI_FINISHED
 };
 
 typedef enum CgiState CgiState;
 
 struct Cgi {
+    pid_t pid;
+    // the pool slot waiting for the zygote to reply with the pid
+    struct CgiProc *proc;
     int infd;
     int outfd;
+    int spoolfd;
+    // the part of the spooled memory taken by this request, the script reads it until it's destroyed
+    int spool_memory;
+    char *script_path;
     Request *request;
+    struct in_addr addr;
+    int server_port;
+    int is_tls;
     int req_content_length;
+    int last_req;
+    int use_splice;
+    StatusCode error;
+    // the response head is held back until it has been inspected
+    char head[CGI_HEAD_MAX_SIZE];
+    int head_len;
+    int head_sent;
+    int head_done;
+    int eof;
+    int head_end;
+    int status_code;
+    int res_len;
+    int res_content_length;
+    char *redirect_path;
+    // a copy of the response for the cache, NULL when it isn't cacheable
+    char *cache_key;
+    int cache_ttl;
+    char *capture;
+    int capture_len;
+    int capture_cap;
+    // the leader relays its response to identical requests waiting on the flight
+    Flight *flight;
+    int flight_leader;
+    int flight_offset;
     CgiState state;
+    long long queued_at;
+    struct Cgi *queue_prev;
+    struct Cgi *queue_next;
 };
 
 typedef struct Cgi Cgi;
 
 int cgi_can_handle(Request *request);
 
+// bodies larger than the threshold are spooled before the script starts, 0 disables spooling
+void cgi_set_spool_threshold(int threshold);
+
+// responses are cached for ttl milliseconds, keyed on the comma separated vary headers, 0 disables caching
+void cgi_set_cache(int ttl, const char *vary);
+
+CacheEntry *cgi_cache_lookup(Request *request);
+
+// identical GET/HEAD requests arriving while one runs share its response
+void cgi_set_coalesce(int enabled);
+
 void cgi_init(Cgi *cgi, char *script_path,
               Request *request, struct in_addr addr,
               int server_port, int is_tls);
 
+void cgi_spool(Cgi *cgi, Buffer *buf);
+
+int cgi_schedule(Cgi *cgi);
+
+// the reply of the zygote, pid is -1 if the script couldn't be started
+void cgi_spawned(Cgi *cgi, pid_t pid);
+
 int cgi_read(Cgi *cgi, Buffer *buf);
 
 int cgi_write(Cgi *cgi, Buffer *buf);
 
+// the static request a X-Sendfile or X-Accel-Redirect response is replaced with
+Request *cgi_redirect_request(Cgi *cgi);
+
+int cgi_can_splice(Cgi *cgi);
+
+// zero-copy relays between the pipes and a plaintext client socket
+// the bytes moved are added to *count
+int cgi_splice_read(Cgi *cgi, int sockfd, long long *count);
+
+int cgi_splice_write(Cgi *cgi, int sockfd, long long *count);
+
 void cgi_destroy(Cgi *cgi);
 
 #endif
\ No newline at end of file
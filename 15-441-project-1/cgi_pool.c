@@ -0,0 +1,250 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+
+#include "cgi_pool.h"
+#include "io.h"
+#include "utils.h"
+#include "log.h"
+#include "probes.h"
+#include "zygote.h"
+
+// without pidfd, look for exited processes at least once a second
+#define CGI_POOL_POLL_INTERVAL 1000
+
+static int max_procs;
+static int queue_timeout;
+static int run_timeout;
+
+static int num_procs;
+static CgiProc* procs;
+
+static Cgi* queue_head;
+static Cgi* queue_tail;
+
+static struct pollfd* pollfds;
+static int pollfds_size;
+
+static int open_pidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    return -1;
+#endif
+}
+
+// a pidfd keeps pointing to the process even if its pid has been reused
+static void kill_proc(CgiProc* proc) {
+#ifdef SYS_pidfd_send_signal
+    if (proc->pidfd >= 0) {
+        syscall(SYS_pidfd_send_signal, proc->pidfd, SIGKILL, NULL, 0);
+        return;
+    }
+#endif
+    kill(proc->pid, SIGKILL);
+}
+
+// without pidfd, the children of the zygote aren't ours to wait for
+static int proc_exited(CgiProc* proc) {
+    int ret = waitpid(proc->pid, NULL, WNOHANG);
+    if (ret < 0 && errno == ECHILD) {
+        return kill(proc->pid, 0) < 0 && errno == ESRCH;
+    }
+    return ret != 0;
+}
+
+// only the head of the queue may start, it has no fd to be woken up by
+static void wake_queue() {
+    if (queue_head != NULL && (max_procs <= 0 || num_procs < max_procs)) {
+        io_need_timeout(0);
+    }
+}
+
+void cgi_pool_init(int max, int queue_ms, int run_ms) {
+    max_procs = max;
+    queue_timeout = queue_ms;
+    run_timeout = run_ms;
+    num_procs = 0;
+    procs = NULL;
+    queue_head = queue_tail = NULL;
+    pollfds = NULL;
+    pollfds_size = 0;
+}
+
+void cgi_pool_enqueue(Cgi* cgi) {
+    cgi->queued_at = get_monotonic_time_ms();
+    cgi->queue_prev = queue_tail;
+    cgi->queue_next = NULL;
+    if (queue_tail != NULL) {
+        queue_tail->queue_next = cgi;
+    } else {
+        queue_head = cgi;
+    }
+    queue_tail = cgi;
+}
+
+void cgi_pool_dequeue(Cgi* cgi) {
+    if (cgi->queue_prev == NULL && queue_head != cgi) {
+        return;
+    }
+    if (cgi->queue_prev != NULL) {
+        cgi->queue_prev->queue_next = cgi->queue_next;
+    } else {
+        queue_head = cgi->queue_next;
+    }
+    if (cgi->queue_next != NULL) {
+        cgi->queue_next->queue_prev = cgi->queue_prev;
+    } else {
+        queue_tail = cgi->queue_prev;
+    }
+    cgi->queue_prev = cgi->queue_next = NULL;
+    wake_queue();
+}
+
+int cgi_pool_can_start(Cgi* cgi) {
+    return queue_head == cgi && (max_procs <= 0 || num_procs < max_procs);
+}
+
+int cgi_pool_is_expired(Cgi* cgi) {
+    if (queue_timeout <= 0) {
+        return 0;
+    }
+    long long remaining = cgi->queued_at + queue_timeout - get_monotonic_time_ms();
+    if (remaining <= 0) {
+        return 1;
+    }
+    io_need_timeout(remaining);
+    return 0;
+}
+
+CgiProc* cgi_pool_add_proc() {
+    CgiProc* proc = (CgiProc*) malloc(sizeof(CgiProc));
+    proc->pid = 0;
+    proc->cgi = NULL;
+    proc->pidfd = -1;
+    proc->killed = 0;
+    proc->deadline = run_timeout > 0 ? get_monotonic_time_ms() + run_timeout : -1;
+    proc->next = procs;
+    procs = proc;
+    num_procs++;
+    if (proc->deadline >= 0) {
+        io_need_timeout(run_timeout);
+    }
+    return proc;
+}
+
+void cgi_pool_set_pid(CgiProc* proc, pid_t pid) {
+    if (proc->cgi != NULL) {
+        cgi_spawned(proc->cgi, pid);
+        proc->cgi = NULL;
+    }
+    if (pid <= 0) {
+        // the slot is given back by the next reap
+        proc->pid = -1;
+        io_need_timeout(0);
+        return;
+    }
+    PROBE1(cgi_spawn, pid);
+    proc->pid = pid;
+    proc->pidfd = open_pidfd(pid);
+    if (proc->pidfd >= 0) {
+        io_need_read(proc->pidfd);
+    } else {
+        io_need_timeout(CGI_POOL_POLL_INTERVAL);
+    }
+}
+
+static void zygote_spawned(void* ctx, pid_t pid) {
+    cgi_pool_set_pid((CgiProc*) ctx, pid);
+}
+
+void cgi_pool_reap() {
+    zygote_poll(zygote_spawned);
+    if (procs == NULL) {
+        return;
+    }
+    // check every pidfd with a single poll
+    if (pollfds_size < num_procs) {
+        pollfds_size = num_procs * 2;
+        pollfds = (struct pollfd*) realloc(pollfds, sizeof(struct pollfd) * pollfds_size);
+    }
+    int i = 0;
+    CgiProc* proc;
+    for (proc = procs; proc != NULL; proc = proc->next, ++i) {
+        pollfds[i].fd = proc->pidfd;
+        pollfds[i].events = POLLIN;
+        pollfds[i].revents = 0;
+    }
+    poll(pollfds, num_procs, 0);
+    long long now = get_monotonic_time_ms();
+    CgiProc** p = &procs;
+    i = 0;
+    while (*p != NULL) {
+        proc = *p;
+        int exited;
+        if (proc->pid <= 0) {
+            // never started, or the zygote hasn't replied yet
+            exited = proc->pid < 0;
+        } else if (proc->pidfd >= 0) {
+            exited = pollfds[i].revents != 0;
+            if (exited) {
+                // reap it if it's our child, the zygote reaps its own children
+                waitpid(proc->pid, NULL, WNOHANG);
+            }
+        } else {
+            exited = proc_exited(proc);
+        }
+        ++i;
+        if (exited) {
+            if (proc->pid > 0) {
+                PROBE1(cgi_exit, proc->pid);
+            }
+            log_(LOG_DEBUG, "Reap the cgi process, pid = %d\n", proc->pid);
+            if (proc->pidfd >= 0) {
+                close(proc->pidfd);
+            }
+            *p = proc->next;
+            free(proc);
+            num_procs--;
+            wake_queue();
+            continue;
+        }
+        if (proc->pid == 0) {
+            p = &(proc->next);
+            continue;
+        }
+        if (proc->deadline >= 0 && !proc->killed) {
+            if (now >= proc->deadline) {
+                log_(LOG_WARN, "Kill the cgi process which runs out of time, pid = %d\n", proc->pid);
+                kill_proc(proc);
+                proc->killed = 1;
+            } else {
+                io_need_timeout(proc->deadline - now);
+            }
+        }
+        if (proc->pidfd >= 0) {
+            io_need_read(proc->pidfd);
+        } else {
+            io_need_timeout(CGI_POOL_POLL_INTERVAL);
+        }
+        p = &(proc->next);
+    }
+}
+
+void cgi_pool_cleanup() {
+    while (procs != NULL) {
+        CgiProc* proc = procs;
+        procs = proc->next;
+        if (proc->pidfd >= 0) {
+            close(proc->pidfd);
+        }
+        free(proc);
+    }
+    free(pollfds);
+    pollfds = NULL;
+    pollfds_size = num_procs = 0;
+}
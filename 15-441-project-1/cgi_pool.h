@@ -0,0 +1,50 @@
+#ifndef __CGI_POOL_H__
+#define __CGI_POOL_H__
+
+#include <sys/types.h>
+
+#include "cgi.h"
+
+#define CGI_POOL_DEFAULT_MAX_PROCS 32
+#define CGI_POOL_DEFAULT_QUEUE_TIMEOUT 5000
+#define CGI_POOL_DEFAULT_RUN_TIMEOUT 30000
+
+struct CgiProc {
+    // 0 until the zygote replies, -1 if the process never started
+    pid_t pid;
+    // the cgi told about the pid once the zygote replies, NULL if it's gone
+    Cgi* cgi;
+    int pidfd;
+    int killed;
+    long long deadline;
+    struct CgiProc* next;
+};
+
+typedef struct CgiProc CgiProc;
+
+/*
+ * Bounds the number of running cgi processes. A cgi waits in a FIFO queue
+ * until a slot is free, and a slot is only given back once the process has
+ * exited. Timeouts are in milliseconds, 0 means no limit.
+ */
+void cgi_pool_init(int max_procs, int queue_timeout, int run_timeout);
+
+void cgi_pool_enqueue(Cgi* cgi);
+
+void cgi_pool_dequeue(Cgi* cgi);
+
+int cgi_pool_can_start(Cgi* cgi);
+
+int cgi_pool_is_expired(Cgi* cgi);
+
+// takes a slot for a process being spawned, its pid is set once known
+CgiProc* cgi_pool_add_proc();
+
+// pid is -1 if the process couldn't be started
+void cgi_pool_set_pid(CgiProc* proc, pid_t pid);
+
+void cgi_pool_reap();
+
+void cgi_pool_cleanup();
+
+#endif
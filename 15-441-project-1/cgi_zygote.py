@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+"""
+    CGI Zygote
+    ~~~~~~~~~~
+
+    A pre-warmed fork server for lisod. It imports the modules used by the
+    cgi script once, then for every request it receives the environment
+    block and the stdin/stdout pipes over the control socket (its own stdin),
+    forks a child and runs the script in it as __main__.
+
+    usage: ./cgi_zygote.py <CGI script path>
+"""
+
+import ast
+import os
+import runpy
+import signal
+import socket
+import struct
+import sys
+import traceback
+
+MAX_ENV_SIZE = 1 << 16
+MAX_FDS = 2
+
+
+def preload(script_path):
+    """Imports every top level module of the script, failures are ignored."""
+    try:
+        with open(script_path) as f:
+            tree = ast.parse(f.read(), script_path)
+    except (IOError, SyntaxError):
+        return
+    sys.path.insert(0, os.path.dirname(os.path.abspath(script_path)))
+    for node in tree.body:
+        if isinstance(node, ast.Import):
+            names = [alias.name for alias in node.names]
+        elif isinstance(node, ast.ImportFrom) and node.level == 0 and node.module:
+            names = [node.module]
+        else:
+            continue
+        for name in names:
+            try:
+                __import__(name)
+            except Exception:
+                pass
+
+
+def run_child(script_path, env, infd, outfd, ctrl):
+    ctrl.close()
+    os.dup2(infd, 0)
+    os.dup2(outfd, 1)
+    os.close(infd)
+    os.close(outfd)
+    signal.signal(signal.SIGCHLD, signal.SIG_DFL)
+    os.environ.clear()
+    os.environ.update(env)
+    sys.argv = [script_path]
+    status = 0
+    try:
+        runpy.run_path(script_path, run_name='__main__')
+    except SystemExit as e:
+        status = e.code if isinstance(e.code, int) else 1
+    except BaseException:
+        traceback.print_exc()
+        status = 1
+    try:
+        sys.stdout.flush()
+    finally:
+        os._exit(status)
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.stderr.write('usage: %s <CGI script path>\n' % sys.argv[0])
+        sys.exit(1)
+    script_path = sys.argv[1]
+    preload(script_path)
+    # children are never waited for
+    signal.signal(signal.SIGCHLD, signal.SIG_IGN)
+    ctrl = socket.socket(fileno=os.dup(0))
+    # keep fd 0 taken so that received pipes never land on it
+    devnull = os.open(os.devnull, os.O_RDONLY)
+    os.dup2(devnull, 0)
+    os.close(devnull)
+    fd_size = socket.CMSG_SPACE(MAX_FDS * struct.calcsize('i'))
+    while True:
+        try:
+            data, ancdata, _, _ = ctrl.recvmsg(MAX_ENV_SIZE, fd_size)
+        except InterruptedError:
+            continue
+        if not data and not ancdata:
+            # lisod went away
+            break
+        fds = []
+        for level, kind, payload in ancdata:
+            if level == socket.SOL_SOCKET and kind == socket.SCM_RIGHTS:
+                fds.extend(struct.unpack('%di' % (len(payload) // 4), payload[:len(payload) - len(payload) % 4]))
+        if len(fds) != MAX_FDS:
+            for fd in fds:
+                os.close(fd)
+            ctrl.send(struct.pack('i', -1))
+            continue
+        env = {}
+        for item in data.split(b'\0'):
+            if item:
+                key, _, value = item.decode('latin-1').partition('=')
+                env[key] = value
+        try:
+            pid = os.fork()
+        except OSError:
+            pid = -1
+        if pid == 0:
+            run_child(script_path, env, fds[0], fds[1], ctrl)
+        for fd in fds:
+            os.close(fd)
+        ctrl.send(struct.pack('i', pid))
+
+
+if __name__ == '__main__':
+    main()
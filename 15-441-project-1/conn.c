@@ -1,8 +1,13 @@
 #include "conn.h"
 #include "io.h"
+#include "utils.h"
 #include "log.h"
+#include "probes.h"
+#include "trace.h"
 
+#include <stdlib.h>
 #include <unistd.h>
+#include <string.h>
 #include <errno.h>
 
 void conn_init(Conn *conn, int sockfd, SSL *ssl, struct in_addr addr) {
@@ -11,11 +16,91 @@ void conn_init(Conn *conn, int sockfd, SSL *ssl, struct in_addr addr) {
     conn->ssl = ssl;
     conn->cgi = NULL;
     conn->handle = NULL;
+    conn->plugin = NULL;
+    conn->proxy = NULL;
     buffer_init(&(conn->in_buf));
     buffer_init(&(conn->out_buf));
     parser_init(&(conn->parser));
     conn->state = RECV_REQ_HEAD;
     conn->prev = conn->next = NULL;
+    conn->accepted_at = get_monotonic_time_us();
+    conn->last_io_at = conn->accepted_at;
+    conn->tls_established = 0;
+    conn->turn_bytes = 0;
+    conn->requeued = 0;
+    memset(&(conn->access), 0, sizeof(AccessRecord));
+    conn->route = METRICS_STATIC;
+}
+
+void conn_account(Conn *conn, long long received, long long sent) {
+    if (received + sent == 0) {
+        return;
+    }
+    conn->access.bytes_in += received;
+    conn->access.bytes_out += sent;
+    conn->turn_bytes += received + sent;
+    conn->last_io_at = get_monotonic_time_us();
+}
+
+long long conn_remaining(Conn *conn) {
+    long long remaining = buffer_output_size(&(conn->out_buf));
+    if (conn->handle != NULL) {
+        Handle *handle = conn->handle;
+        remaining += handle->entry != NULL ? handle->entry->len - handle->entry_offset : handle->res_content_length;
+    } else if (conn->cgi != NULL || conn->plugin != NULL || conn->proxy != NULL) {
+        remaining += CONN_UNKNOWN_REMAINING;
+    }
+    return remaining;
+}
+
+void conn_begin_request(Conn *conn, Request *request) {
+    AccessRecord *access = &(conn->access);
+    access->active = 1;
+    access->accepted_at = conn->accepted_at;
+    access->headers_at = get_monotonic_time_us();
+    conn->route = METRICS_STATIC;
+    access->sampled = access_log_sample();
+    if (!access->sampled) {
+        return;
+    }
+    strncpy(access->method, request->http_method, ACCESS_LOG_MAX_METHOD_SIZE - 1);
+    access->method[ACCESS_LOG_MAX_METHOD_SIZE - 1] = 0;
+    strncpy(access->path, request->abs_path, ACCESS_LOG_MAX_PATH_SIZE - 1);
+    access->path[ACCESS_LOG_MAX_PATH_SIZE - 1] = 0;
+}
+
+void conn_end_request(Conn *conn) {
+    AccessRecord *access = &(conn->access);
+    if (access->active) {
+        long long now = get_monotonic_time_us();
+        metrics_request(conn->route, access->status, access->bytes_in, access->bytes_out, now - access->headers_at);
+        PROBE4(request_done, conn->sockfd, conn->route, access->status, now - access->headers_at);
+        if (access->sampled) {
+            access->last_byte_at = access->first_byte_at > 0 ? now : 0;
+            access_log_write(access, conn->addr, conn->ssl != NULL);
+        }
+    }
+    // bytes received past this request belong to the next one
+    long long pending = buffer_output_size(&(conn->in_buf));
+    memset(access, 0, sizeof(AccessRecord));
+    access->bytes_in = pending;
+}
+
+static void tls_established(Conn *conn) {
+    if (!conn->tls_established && SSL_is_init_finished(conn->ssl)) {
+        conn->tls_established = 1;
+        metrics_tls_handshake();
+    }
+}
+
+// the status is taken from the status line as the first bytes of a response go out
+static void access_first_byte(Conn *conn) {
+    AccessRecord *access = &(conn->access);
+    Buffer *buf = &(conn->out_buf);
+    access->first_byte_at = get_monotonic_time_us();
+    if (buffer_output_size(buf) >= 12 && !strncmp(buffer_output_ptr(buf), "HTTP/", 5)) {
+        access->status = atoi(buffer_output_ptr(buf) + 9);
+    }
 }
 
 int conn_send(Conn *conn) {
@@ -26,9 +111,14 @@ int conn_send(Conn *conn) {
     if (io_wait_read(conn->sockfd) || io_wait_write(conn->sockfd)) {
         return 0;
     }
+    if (conn->access.active && conn->access.first_byte_at == 0) {
+        access_first_byte(conn);
+    }
     int ret;
     if (conn->ssl != NULL) {
+        TRACE_BEGIN(span);
         ret = SSL_write(conn->ssl, buffer_output_ptr(buf), buffer_output_size(buf));
+        TRACE_END(span, "ssl_write", conn->sockfd);
         if (ret <= 0) {
             switch (SSL_get_error(conn->ssl, ret)) {
                 case SSL_ERROR_WANT_READ:
@@ -42,6 +132,7 @@ int conn_send(Conn *conn) {
                     return 1;
             }
         }
+        tls_established(conn);
     } else {
         ret = send(conn->sockfd, buffer_output_ptr(buf), buffer_output_size(buf), 0);
         if (ret < 0) {
@@ -56,6 +147,8 @@ int conn_send(Conn *conn) {
         }
     }
     buffer_output(buf, ret);
+    conn_account(conn, 0, ret);
+    PROBE2(send, conn->sockfd, ret);
     log_(LOG_DEBUG, "Connection send %d byte(s)\n", ret);
     return 1;
 }
@@ -70,7 +163,9 @@ int conn_recv(Conn *conn) {
     }
     int ret;
     if (conn->ssl != NULL) {
+        TRACE_BEGIN(span);
         ret = SSL_read(conn->ssl, buffer_input_ptr(buf), buffer_input_size(buf));
+        TRACE_END(span, "ssl_read", conn->sockfd);
         if (ret <= 0) {
             switch (SSL_get_error(conn->ssl, ret)) {
                 case SSL_ERROR_WANT_READ:
@@ -84,6 +179,7 @@ int conn_recv(Conn *conn) {
                     return 1;
             }
         }
+        tls_established(conn);
     } else {
         ret = recv(conn->sockfd, buffer_input_ptr(buf), buffer_input_size(buf), 0);
         if (ret < 0) {
@@ -101,11 +197,14 @@ int conn_recv(Conn *conn) {
         }
     }
     buffer_input(buf, ret);
+    conn_account(conn, ret, 0);
+    PROBE2(recv, conn->sockfd, ret);
     log_(LOG_DEBUG, "Connection receive %d byte(s)\n", ret);
     return 1;
 }
 
 void conn_destroy(Conn *conn) {
+    conn_end_request(conn);
     if (conn->ssl != NULL) {
         SSL_shutdown(conn->ssl);
         SSL_free(conn->ssl);
@@ -118,5 +217,13 @@ void conn_destroy(Conn *conn) {
         cgi_destroy(conn->cgi);
         free(conn->cgi);
     }
+    if (conn->plugin != NULL) {
+        plugin_destroy(conn->plugin);
+        free(conn->plugin);
+    }
+    if (conn->proxy != NULL) {
+        proxy_destroy(conn->proxy);
+        free(conn->proxy);
+    }
     close(conn->sockfd);
 }
@@ -8,6 +8,17 @@
 #include "parse.h"
 #include "cgi.h"
 #include "handle.h"
+#include "plugin.h"
+#include "proxy.h"
+#include "access_log.h"
+#include "metrics.h"
+
+// a turn of handle_conn ends after this many bytes or state steps, so one
+// busy connection can't keep the others waiting
+#define CONN_DEFAULT_TURN_BYTES (256 << 10)
+#define CONN_TURN_MAX_STEPS 256
+// what a response of unknown length counts as when the shortest go first
+#define CONN_UNKNOWN_REMAINING (1 << 20)
 
 enum ConnState {
     RECV_REQ_HEAD,
@@ -15,6 +26,10 @@ enum ConnState {
     SEND_RES,
     CGI_RECV_REQ_BODY,
     CGI_SEND_RES,
+    PLUGIN_RECV_REQ_BODY,
+    PLUGIN_SEND_RES,
+    PROXY_RECV_REQ_BODY,
+    PROXY_SEND_RES,
     CONN_CLOSE
 };
 
@@ -26,10 +41,21 @@ struct Conn {
     SSL* ssl;
     Handle* handle;
     Cgi* cgi;
+    Plugin* plugin;
+    Proxy* proxy;
     Parser parser;
     Buffer in_buf;
     Buffer out_buf;
     ConnState state; 
+    long long accepted_at;
+    long long last_io_at;
+    int tls_established;
+    long long turn_bytes;
+    // the last turn ran out of budget, the connection still has work
+    int requeued;
+    // the request in progress, its name and timings are only filled in when it's sampled
+    AccessRecord access;
+    MetricsRoute route;
     struct Conn* prev;
     struct Conn* next;
 };
@@ -42,6 +68,17 @@ int conn_send(Conn* conn);
 
 int conn_recv(Conn* conn);
 
+// counts socket bytes moved outside of conn_send and conn_recv too
+void conn_account(Conn* conn, long long received, long long sent);
+
+// the response bytes still to be sent, as far as they're known
+long long conn_remaining(Conn* conn);
+
+// called once the request is parsed and once its response is complete
+void conn_begin_request(Conn* conn, Request* request);
+
+void conn_end_request(Conn* conn);
+
 void conn_destroy(Conn* conn);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,306 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+#include "diskio.h"
+#include "io.h"
+#include "utils.h"
+#include "log.h"
+#include "trace.h"
+
+#define DISKIO_MAX_THREADS 64
+
+static pthread_t threads[DISKIO_MAX_THREADS];
+static int num_threads;
+// a counter bumped by the threads whenever a job is done
+static int efd = -1;
+// cleared once preadv2 turns out not to support RWF_NOWAIT here
+static int nowait_supported = 1;
+static long long drop_size = DISKIO_DEFAULT_DROP_SIZE;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static DiskJob* queue_head;
+static DiskJob* queue_tail;
+static int stopping;
+// abandoned jobs whose release callback is run by the loop
+static DiskJob* released;
+
+static void job_free(DiskJob* job) {
+    if (job->type == DISKIO_OPEN && job->fd >= 0) {
+        close(job->fd);
+    }
+    free(job->path);
+    free(job->data);
+    free(job);
+}
+
+static void run_open(DiskJob* job) {
+    TRACE_BEGIN(span);
+    // the path is a directory
+    if (!job->resolved && stat(job->path, &(job->st)) == 0 && S_ISDIR(job->st.st_mode)) {
+        strcat(job->path, "/index.html");
+    }
+    if (job->type == DISKIO_OPEN) {
+        job->fd = open(job->path, O_RDONLY | O_CLOEXEC);
+        if (job->fd < 0 || (!job->resolved && fstat(job->fd, &(job->st)) != 0)) {
+            job->err = errno;
+        } else {
+            // the file is sent from start to end, have the kernel read ahead further and start right away
+            posix_fadvise(job->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            posix_fadvise(job->fd, 0, job->st.st_size < DISKIO_WILLNEED_SIZE ? job->st.st_size : DISKIO_WILLNEED_SIZE,
+                          POSIX_FADV_WILLNEED);
+        }
+    } else if (stat(job->path, &(job->st)) != 0) {
+        job->err = errno;
+    }
+    TRACE_END(span, "file_open", job->fd);
+}
+
+static void run_read(DiskJob* job) {
+    TRACE_BEGIN(span);
+    job->len = pread(job->fd, job->data, job->size, job->offset);
+    if (job->len < 0) {
+        job->err = errno;
+    }
+    TRACE_END(span, "file_read", job->fd);
+}
+
+static void run(DiskJob* job) {
+    if (job->type == DISKIO_READ) {
+        run_read(job);
+    } else {
+        run_open(job);
+    }
+}
+
+static void* worker(void* arg) {
+    while (1) {
+        pthread_mutex_lock(&lock);
+        while (queue_head == NULL && !stopping) {
+            pthread_cond_wait(&cond, &lock);
+        }
+        DiskJob* job = queue_head;
+        if (job == NULL) {
+            pthread_mutex_unlock(&lock);
+            return NULL;
+        }
+        queue_head = job->next;
+        if (queue_head == NULL) {
+            queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&lock);
+        run(job);
+        pthread_mutex_lock(&lock);
+        __atomic_store_n(&(job->done), 1, __ATOMIC_RELEASE);
+        int abandoned = job->abandoned;
+        if (abandoned && job->release != NULL) {
+            job->next = released;
+            released = job;
+        }
+        pthread_mutex_unlock(&lock);
+        if (abandoned && job->release == NULL) {
+            job_free(job);
+        } else {
+            uint64_t one = 1;
+            if (write(efd, &one, sizeof(one)) < 0) {
+                // the counter can't overflow, the loop drains it every iteration
+            }
+        }
+    }
+}
+
+static void submit(DiskJob* job) {
+    job->done = 0;
+    job->abandoned = 0;
+    job->err = 0;
+    job->next = NULL;
+    if (num_threads == 0) {
+        run(job);
+        job->done = 1;
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    if (queue_tail != NULL) {
+        queue_tail->next = job;
+    } else {
+        queue_head = job;
+    }
+    queue_tail = job;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+int diskio_init(int n) {
+    num_threads = 0;
+    stopping = 0;
+    if (n <= 0) {
+        return 1;
+    }
+    if ((efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        log_(LOG_ERROR, "Error creating the disk io eventfd.\n");
+        return 0;
+    }
+    n = min(n, DISKIO_MAX_THREADS);
+    for (num_threads = 0; num_threads != n; ++num_threads) {
+        if (pthread_create(&threads[num_threads], NULL, worker, NULL) != 0) {
+            log_(LOG_ERROR, "Error creating a disk io thread.\n");
+            break;
+        }
+    }
+    return num_threads > 0;
+}
+
+void diskio_set_drop_size(long long size) {
+    drop_size = size;
+}
+
+int diskio_drops(long long file_size) {
+    return drop_size > 0 && file_size >= drop_size;
+}
+
+void diskio_drop(int fd, long long offset, long long len, long long file_size) {
+    if (!diskio_drops(file_size) || len <= 0) {
+        return;
+    }
+    posix_fadvise(fd, offset, len, POSIX_FADV_DONTNEED);
+    log_(LOG_DEBUG, "Drop %lld byte(s) of a sent file from the page cache\n", len);
+}
+
+DiskJob* diskio_open(const char* path, int open_file) {
+    DiskJob* job = (DiskJob*) calloc(1, sizeof(DiskJob));
+    job->type = open_file ? DISKIO_OPEN : DISKIO_STAT;
+    // room for the index.html of a directory
+    job->path = (char*) malloc(strlen(path) + sizeof("/index.html"));
+    strcpy(job->path, path);
+    job->fd = -1;
+    submit(job);
+    return job;
+}
+
+DiskJob* diskio_open_resolved(const char* path, long long size, time_t ctime) {
+    DiskJob* job = (DiskJob*) calloc(1, sizeof(DiskJob));
+    job->type = DISKIO_OPEN;
+    job->path = new_str(path);
+    job->st.st_size = size;
+    job->st.st_ctime = ctime;
+    job->resolved = 1;
+    job->fd = -1;
+    submit(job);
+    return job;
+}
+
+DiskJob* diskio_read(DiskJob* job, int fd, long long offset, int len) {
+    if (job == NULL) {
+        job = (DiskJob*) calloc(1, sizeof(DiskJob));
+        job->type = DISKIO_READ;
+        job->data = (char*) malloc(DISKIO_READ_SIZE);
+    }
+    job->fd = fd;
+    job->offset = offset;
+    job->size = min(len, DISKIO_READ_SIZE);
+    job->len = 0;
+    if (num_threads > 0 && nowait_supported) {
+        // served inline if it's in the page cache, even partly
+        struct iovec iov = {job->data, job->size};
+        TRACE_BEGIN(span);
+        int ret = preadv2(fd, &iov, 1, offset, RWF_NOWAIT);
+        TRACE_END(span, "file_read", fd);
+        if (ret >= 0) {
+            job->len = ret;
+            job->err = 0;
+            job->done = 1;
+            return job;
+        }
+        if (errno != EAGAIN) {
+            log_(LOG_INFO, "preadv2 doesn't support RWF_NOWAIT, every read goes to the disk threads\n");
+            nowait_supported = 0;
+        }
+    }
+    submit(job);
+    return job;
+}
+
+int diskio_done(DiskJob* job) {
+    if (__atomic_load_n(&(job->done), __ATOMIC_ACQUIRE)) {
+        return 1;
+    }
+    io_need_read(efd);
+    return 0;
+}
+
+void diskio_release_then(DiskJob* job, void (*release)(DiskJob* job, void* ctx), void* ctx) {
+    if (job == NULL) {
+        return;
+    }
+    if (num_threads > 0) {
+        pthread_mutex_lock(&lock);
+        if (!job->done) {
+            job->abandoned = 1;
+            job->release = release;
+            job->release_ctx = ctx;
+            job = NULL;
+        }
+        pthread_mutex_unlock(&lock);
+    }
+    if (job != NULL) {
+        if (release != NULL) {
+            release(job, ctx);
+        }
+        job_free(job);
+    }
+}
+
+void diskio_release(DiskJob* job) {
+    diskio_release_then(job, NULL, NULL);
+}
+
+static void run_released() {
+    pthread_mutex_lock(&lock);
+    DiskJob* job = released;
+    released = NULL;
+    pthread_mutex_unlock(&lock);
+    while (job != NULL) {
+        DiskJob* next = job->next;
+        job->release(job, job->release_ctx);
+        job_free(job);
+        job = next;
+    }
+}
+
+void diskio_poll() {
+    if (efd < 0) {
+        return;
+    }
+    uint64_t count;
+    if (read(efd, &count, sizeof(count)) < 0) {
+        // EAGAIN, nothing is done since the last poll
+    }
+    run_released();
+}
+
+void diskio_cleanup() {
+    int i;
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+    // the jobs still queued are abandoned, the threads free them on their way out
+    for (i = 0; i != num_threads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    num_threads = 0;
+    run_released();
+    if (efd >= 0) {
+        close(efd);
+        efd = -1;
+    }
+}
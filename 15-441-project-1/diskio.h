@@ -0,0 +1,93 @@
+#ifndef __DISKIO_H__
+#define __DISKIO_H__
+
+#include <sys/stat.h>
+
+#define DISKIO_DEFAULT_THREADS 4
+// a read job stages at most this much of a file
+#define DISKIO_READ_SIZE (1 << 16)
+// opened files are read ahead up to this much right away
+#define DISKIO_WILLNEED_SIZE (1 << 20)
+// files at least this large are dropped from the page cache behind the
+// download, this much at a time
+#define DISKIO_DEFAULT_DROP_SIZE (64 << 20)
+#define DISKIO_DROP_WINDOW (1 << 20)
+
+enum DiskJobType {
+    DISKIO_OPEN,
+    DISKIO_STAT,
+    DISKIO_READ
+};
+
+typedef enum DiskJobType DiskJobType;
+
+/*
+ * A file system call run by the disk threads. The loop polls done, the
+ * results are only valid once it's set.
+ */
+struct DiskJob {
+    DiskJobType type;
+    // OPEN and STAT: a directory is resolved to its index.html
+    char* path;
+    struct stat st;
+    // OPEN of a path looked up before, st is already filled in
+    int resolved;
+    // the opened file for OPEN, take it by setting fd to -1, the file read for READ
+    int fd;
+    long long offset;
+    char* data;
+    int size;
+    int len;
+    int err;
+    int done;
+    int abandoned;
+    // called by the loop once an abandoned job is no longer run
+    void (*release)(struct DiskJob* job, void* ctx);
+    void* release_ctx;
+    struct DiskJob* next;
+};
+
+typedef struct DiskJob DiskJob;
+
+// with 0 threads every job runs inline
+int diskio_init(int num_threads);
+
+// 0 keeps every file in the page cache
+void diskio_set_drop_size(long long size);
+
+// opens the file, or only stats it if open_file is 0
+DiskJob* diskio_open(const char* path, int open_file);
+
+// opens a file known to be there, with the size and ctime it was found with
+DiskJob* diskio_open_resolved(const char* path, long long size, time_t ctime);
+
+/*
+ * Reads up to len bytes at offset, reusing job if it isn't NULL. Reads served
+ * by the page cache are done inline, only the others go to the threads.
+ */
+DiskJob* diskio_read(DiskJob* job, int fd, long long offset, int len);
+
+// whether a file of this size is dropped from the page cache as it's sent
+int diskio_drops(long long file_size);
+
+// drops len bytes at offset of an already sent file from the page cache if the file is large enough
+void diskio_drop(int fd, long long offset, long long len, long long file_size);
+
+// whether the job is done, the loop is woken up when it isn't yet
+int diskio_done(DiskJob* job);
+
+// frees the job, or leaves it to the thread still running it
+void diskio_release(DiskJob* job);
+
+/*
+ * Frees the job and calls release, right away or from diskio_poll once the
+ * thread running it is done, e.g. to close the file it reads.
+ */
+void diskio_release_then(DiskJob* job, void (*release)(DiskJob* job, void* ctx), void* ctx);
+
+// takes the completion notifications, call it after each io wait
+void diskio_poll();
+
+void diskio_cleanup();
+
+#endif
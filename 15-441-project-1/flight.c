@@ -0,0 +1,111 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "flight.h"
+#include "io.h"
+#include "utils.h"
+#include "log.h"
+
+static Flight* buckets[FLIGHT_NUM_BUCKETS];
+
+static unsigned int hash(const char* key) {
+    unsigned int h = 5381;
+    while (*key) {
+        h = h * 33 + (unsigned char) *key++;
+    }
+    return h % FLIGHT_NUM_BUCKETS;
+}
+
+static void flight_unlink(Flight* flight) {
+    if (!flight->linked) {
+        return;
+    }
+    Flight** p = &buckets[hash(flight->key)];
+    while (*p != flight) {
+        p = &((*p)->hash_next);
+    }
+    *p = flight->hash_next;
+    flight->linked = 0;
+}
+
+// waiters have no fd to wait on, make the event loop come around again
+static void flight_notify(Flight* flight) {
+    if (flight->refcount > 1) {
+        io_need_timeout(0);
+    }
+}
+
+Flight* flight_join(const char* key) {
+    Flight* flight = buckets[hash(key)];
+    while (flight != NULL && strcmp(flight->key, key)) {
+        flight = flight->hash_next;
+    }
+    if (flight == NULL) {
+        return NULL;
+    }
+    flight->refcount++;
+    log_(LOG_DEBUG, "Join the flight of %d waiter(s)\n", flight->refcount - 1);
+    return flight;
+}
+
+Flight* flight_begin(const char* key) {
+    Flight* flight = (Flight*) malloc(sizeof(Flight));
+    flight->key = new_str(key);
+    flight->data = NULL;
+    flight->len = flight->cap = 0;
+    flight->state = FLIGHT_RUNNING;
+    flight->refcount = 1;
+    flight->linked = 1;
+    unsigned int h = hash(key);
+    flight->hash_next = buckets[h];
+    buckets[h] = flight;
+    return flight;
+}
+
+int flight_append(Flight* flight, const char* data, int len) {
+    if (flight->state != FLIGHT_RUNNING) {
+        return 0;
+    }
+    if (flight->refcount == 1) {
+        // nobody waits, a request arriving from now on runs the script itself
+        flight_unlink(flight);
+        return 0;
+    }
+    if (len <= 0) {
+        return 1;
+    }
+    if (flight->len + len > FLIGHT_MAX_SIZE) {
+        // the whole response is buffered for the slowest waiter, don't let it grow without bound
+        log_(LOG_DEBUG, "Abandon the flight of %d waiter(s) due to the response is too large\n",
+             flight->refcount - 1);
+        flight_finish(flight, 0);
+        return 0;
+    }
+    if (flight->len + len > flight->cap) {
+        flight->cap = max(flight->cap * 2, flight->len + len);
+        flight->data = (char*) realloc(flight->data, flight->cap);
+    }
+    memcpy(flight->data + flight->len, data, len);
+    flight->len += len;
+    flight_notify(flight);
+    return 1;
+}
+
+void flight_finish(Flight* flight, int ok) {
+    if (flight->state != FLIGHT_RUNNING) {
+        return;
+    }
+    flight->state = ok ? FLIGHT_DONE : FLIGHT_ABANDONED;
+    flight_unlink(flight);
+    flight_notify(flight);
+}
+
+void flight_release(Flight* flight) {
+    flight->refcount--;
+    if (flight->refcount == 0) {
+        flight_unlink(flight);
+        free(flight->key);
+        free(flight->data);
+        free(flight);
+    }
+}
@@ -0,0 +1,45 @@
+#ifndef __FLIGHT_H__
+#define __FLIGHT_H__
+
+#define FLIGHT_NUM_BUCKETS 256
+
+// past this size a flight is abandoned, waiters which got nothing yet run the script themselves
+#define FLIGHT_MAX_SIZE (8 << 20)
+
+enum FlightState {
+    FLIGHT_RUNNING,
+    FLIGHT_DONE,
+    FLIGHT_ABANDONED
+};
+
+typedef enum FlightState FlightState;
+
+// the response of a request in progress, shared with identical requests arriving meanwhile
+struct Flight {
+    char* key;
+    char* data;
+    int len;
+    int cap;
+    FlightState state;
+    int refcount;
+    int linked;
+    struct Flight* hash_next;
+};
+
+typedef struct Flight Flight;
+
+// returns a referenced flight running for key or NULL
+Flight* flight_join(const char* key);
+
+// registers a new flight for key, the caller holds the first reference
+Flight* flight_begin(const char* key);
+
+// returns 0 once no waiter is left to read the flight, the leader should leave it then
+int flight_append(Flight* flight, const char* data, int len);
+
+// ok is 0 when the response is incomplete or can't be shared
+void flight_finish(Flight* flight, int ok);
+
+void flight_release(Flight* flight);
+
+#endif
@@ -1,83 +1,194 @@
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
+#include <limits.h>
 #include <sys/stat.h>
 
 #include "handle.h"
+#include "meta.h"
 #include "utils.h"
 #include "log.h"
 
-static char tmpbuf[4096];
-
 static int check_http_version(Request* request) {
     return strcmp(request->http_version, "HTTP/1.1") == 0;
 }
 
-static Response* do_get(Handle* handle) { 
-    if (!check_http_version(handle->request)) {
-        return response_error(HTTP_VERSION_NOT_SUPPORTED);
+// the content codings of the precompressed siblings, in the order they're preferred
+static const char* encodings[HANDLE_NUM_ENCODINGS][2] = {{"br", ".br"},
+                                                         {"zstd", ".zst"},
+                                                         {"gzip", ".gz"}};
+
+static int precompressed = 0;
+
+void handle_set_precompressed(int enabled) {
+    precompressed = enabled;
+}
+
+// a bit for each of the encodings the Accept-Encoding of the request allows
+static int accepted_encodings(Request* request) {
+    const char* p = request_get_header(request, "Accept-Encoding");
+    int accepted = 0, refused = 0, wildcard = 0;
+    if (!precompressed || p == NULL) {
+        return 0;
     }
-    char* path = tmpbuf;
-    strcpy(path, handle->www_folder);
-    strcat(path, "/");
-    strcat(path, handle->request->abs_path);
-    struct stat statbuf;
-    // the path is a directory
-    if (stat(path, &statbuf) == 0 && S_ISDIR(statbuf.st_mode)) {
-        strcat(path, "/index.html");
-    }
-    FILE* file = fopen(path, "r");
-    if (file == NULL || stat(path, &statbuf) != 0) {
-        return response_error(NOT_FOUND);
+    while (*(p += strspn(p, " \t,")) != 0) {
+        int name_len = strcspn(p, " \t,;");
+        const char* end = p + strcspn(p, ",");
+        const char* param = p + name_len;
+        double q = 1;
+        while (param < end) {
+            param += strspn(param, " \t;");
+            if (!strncasecmp(param, "q=", 2)) {
+                q = atof(param + 2);
+            }
+            param += strcspn(param, ";,");
+        }
+        int i;
+        for (i = 0; i != HANDLE_NUM_ENCODINGS; ++i) {
+            if ((int) strlen(encodings[i][0]) == name_len && !strncasecmp(p, encodings[i][0], name_len)) {
+                *(q > 0 ? &accepted : &refused) |= 1 << i;
+            }
+        }
+        if (name_len == 1 && *p == '*' && q > 0) {
+            wildcard = 1;
+        }
+        p = end;
+    }
+    if (wildcard) {
+        accepted |= ((1 << HANDLE_NUM_ENCODINGS) - 1) & ~refused;
     }
-    int content_length = statbuf.st_size;
-    handle->file = file;
-    handle->res_content_length = content_length;
+    return accepted;
+}
+
+// the request path, or the one of the sibling tried, a directory's being its index.html's
+static int file_key(Handle* handle, char* key, int size) {
+    const char* abs_path = handle->request->abs_path;
+    if (handle->encoding == HANDLE_NUM_ENCODINGS) {
+        return snprintf(key, size, "%s", abs_path) < size;
+    }
+    int len = strlen(abs_path);
+    return snprintf(key, size, "%s%s%s", abs_path, len > 0 && abs_path[len - 1] == '/' ? "index.html" : "",
+                    encodings[handle->encoding][1]) < size;
+}
+
+// the response of a GET or HEAD to a file found with this metadata, mime_type is looked up if NULL
+static Response* file_response(Handle* handle, const char* path, const char* mime_type, long long size,
+                               time_t ctime) {
     Response* response = (Response*)malloc(sizeof(Response));
     response_init(response, OK);
-    response_add_header(response, "Content-Type", get_mimetype(get_filename_ext(path)));
-    char* str = tmpbuf;
-    sprintf(str, "%d", content_length);
+    if (handle->encoding == HANDLE_NUM_ENCODINGS) {
+        response_add_header(response, "Content-Type",
+                            mime_type != NULL ? mime_type : get_mimetype(get_filename_ext(path)));
+    } else {
+        // the type of the file the sibling was compressed from
+        char original[PATH_MAX];
+        snprintf(original, sizeof(original), "%s", path);
+        original[strlen(original) - strlen(encodings[handle->encoding][1])] = 0;
+        response_add_header(response, "Content-Type", get_mimetype(get_filename_ext(original)));
+        response_add_header(response, "Content-Encoding", encodings[handle->encoding][0]);
+    }
+    if (precompressed) {
+        response_add_header(response, "Vary", "Accept-Encoding");
+    }
+    char str[64];
+    sprintf(str, "%lld", size);
     response_add_header(response, "Content-Length", str);
-    get_http_format_date(&(statbuf.st_ctime), str, sizeof(tmpbuf));
+    get_http_format_date(&ctime, str, sizeof(str));
     response_add_header(response, "Last-Modified", str);
     return response;
 }
 
-static Response* do_post(Handle* handle) {
-    if (!check_http_version(handle->request)) {
-        return response_error(HTTP_VERSION_NOT_SUPPORTED);
+static Response* open_file(Handle* handle, int is_get);
+
+// the response once the file is opened or stat'ed, NULL if the next sibling is looked up
+static Response* job_response(Handle* handle, int is_get) {
+    DiskJob* job = handle->job;
+    char key[PATH_MAX];
+    file_key(handle, key, sizeof(key));
+    if (!job->resolved) {
+        meta_store(key, job, handle->meta_generation);
     }
-    Response* response = (Response*)malloc(sizeof(Response));
-    response_init(response, OK);
+    Response* response;
+    if (job->err != 0 && handle->encoding != HANDLE_NUM_ENCODINGS) {
+        diskio_release(job);
+        handle->job = NULL;
+        handle->encoding++;
+        return open_file(handle, is_get);
+    } else if (job->err != 0) {
+        response = response_error(NOT_FOUND);
+    } else {
+        int content_length = job->st.st_size;
+        if (job->type == DISKIO_OPEN) {
+            handle->fd = job->fd;
+            job->fd = -1;
+            handle->res_content_length = content_length;
+            handle->file_size = content_length;
+            // files dropped from the page cache behind each download aren't shared
+            if (!diskio_drops(content_length)
+                && (handle->file = meta_store_file(key, handle->fd, handle->meta_generation))) {
+                handle->fd = handle->file->fd;
+            }
+        }
+        response = file_response(handle, job->path, NULL, content_length, job->st.st_ctime);
+    }
+    diskio_release(job);
+    handle->job = NULL;
     return response;
 }
 
-static Response* do_head(Handle* handle) {
-    if (!check_http_version(handle->request)) {
-        return response_error(HTTP_VERSION_NOT_SUPPORTED);
+/*
+ * Answers a HEAD, a missing file or a GET of a file kept open right away
+ * from the metadata cache, otherwise starts opening the file of a GET, or
+ * stat'ing it for a HEAD, and returns NULL. The precompressed siblings the
+ * client accepts are tried first, from handle->encoding on.
+ */
+static Response* open_file(Handle* handle, int is_get) {
+    char key[PATH_MAX];
+    while (handle->encoding != HANDLE_NUM_ENCODINGS
+           && (!(handle->accepted & (1 << handle->encoding)) || !file_key(handle, key, sizeof(key)))) {
+        handle->encoding++;
     }
-    char* path = tmpbuf;
-    strcpy(path, handle->www_folder);
-    strcat(path, "/");
-    strcat(path, handle->request->abs_path);
-    struct stat statbuf;
-    // the path is a directory
-    if (stat(path, &statbuf) == 0 && S_ISDIR(statbuf.st_mode)) {
-        strcat(path, "/index.html");
+    if (!file_key(handle, key, sizeof(key))) {
+        return response_error(NOT_FOUND);
+    }
+    MetaEntry* meta = meta_lookup(key);
+    if (meta != NULL && meta->err != 0 && handle->encoding != HANDLE_NUM_ENCODINGS) {
+        handle->encoding++;
+        return open_file(handle, is_get);
     }
-    if (stat(path, &statbuf) != 0) {
+    if (meta != NULL && meta->err != 0) {
         return response_error(NOT_FOUND);
     }
-    int content_length = statbuf.st_size;
+    if (meta != NULL && is_get && (handle->file = meta_open_file(meta)) != NULL) {
+        handle->fd = handle->file->fd;
+        handle->res_content_length = meta->size;
+        handle->file_size = meta->size;
+    }
+    if (meta != NULL && (!is_get || handle->file != NULL)) {
+        return file_response(handle, meta->path, meta->mime_type, meta->size, meta->ctime);
+    }
+    handle->meta_generation = meta_generation();
+    if (meta != NULL) {
+        handle->job = diskio_open_resolved(meta->path, meta->size, meta->ctime);
+    } else {
+        char path[PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s/%s", handle->www_folder, key) >= (int) sizeof(path)) {
+            return response_error(NOT_FOUND);
+        }
+        handle->job = diskio_open(path, is_get);
+    }
+    handle->resume_state = HANDLE_PROCESS;
+    handle->state = HANDLE_WAIT;
+    return NULL;
+}
+
+static Response* do_post(Handle* handle) {
+    if (!check_http_version(handle->request)) {
+        return response_error(HTTP_VERSION_NOT_SUPPORTED);
+    }
     Response* response = (Response*)malloc(sizeof(Response));
     response_init(response, OK);
-    response_add_header(response, "Content-Type", get_mimetype(get_filename_ext(path)));
-    char* str = tmpbuf;
-    sprintf(str, "%d", content_length);
-    response_add_header(response, "Content-Length", str);
-    get_http_format_date(&(statbuf.st_ctime), str, sizeof(tmpbuf));
-    response_add_header(response, "Last-Modified", str);
     return response;
 }
 
@@ -87,25 +198,53 @@ void handle_init(Handle* handle, char* www_folder, Request* request) {
     handle->req_content_length = 0;
     handle->res_content_length = 0;
     handle->last_req = 0;
+    handle->fd = -1;
+    handle->file_offset = 0;
+    handle->file_size = 0;
+    handle->dropped_offset = 0;
+    handle->job = NULL;
+    handle->job_offset = 0;
+    handle->meta_generation = 0;
     handle->file = NULL;
+    handle->accepted = 0;
+    handle->encoding = HANDLE_NUM_ENCODINGS;
+    handle->entry = NULL;
+    handle->entry_offset = 0;
     handle->state = request->content_length <= 0 ? HANDLE_PROCESS : HANDLE_RECV; 
 }
 
+void handle_init_cached(Handle* handle, Request* request, CacheEntry* entry) {
+    handle_init(handle, NULL, request);
+    handle->entry = entry;
+    handle->res_content_length = entry->len;
+    handle->last_req = request_connection_close(request);
+    handle->state = HANDLE_SEND;
+}
+
 void handle_read(Handle* handle, Buffer* buf) {
     while (1) {
         switch (handle->state) {
             case HANDLE_PROCESS: {
                 Request* request = handle->request;
+                int is_get = !strcmp(request->http_method, "GET");
                 // always close connection according to project document
                 Response* response;
-                if (handle->request->content_length < 0) {
+                if (handle->job != NULL) {
+                    if ((response = job_response(handle, is_get)) == NULL) {
+                        break;
+                    }
+                } else if (handle->request->content_length < 0) {
                     response = response_error(REQUEST_ENTITY_TOO_LARGE);
-                } else if (!strcmp(request->http_method, "GET")) {
-                    response = do_get(handle);
+                } else if ((is_get || !strcmp(request->http_method, "HEAD")) && !check_http_version(request)) {
+                    response = response_error(HTTP_VERSION_NOT_SUPPORTED);
+                } else if (is_get || !strcmp(request->http_method, "HEAD")) {
+                    handle->accepted = accepted_encodings(request);
+                    handle->encoding = 0;
+                    if ((response = open_file(handle, is_get)) == NULL) {
+                        break;
+                    }
                 } else if (!strcmp(request->http_method, "POST")) {
                     response = do_post(handle);
-                } else if (!strcmp(request->http_method, "HEAD")) {
-                    response = do_head(handle);
                 } else {
                     response = response_error(NOT_IMPLEMENTED);
                 }
@@ -120,7 +259,7 @@ void handle_read(Handle* handle, Buffer* buf) {
                 log_(LOG_DEBUG, "Response(length = %d)\n%s", buf->end, buf->data);
                 response_destroy(response);
                 free(response); 
-                if (handle->file != NULL) {
+                if (handle->fd >= 0) {
                     handle->state = HANDLE_SEND;
                 } else {
                     handle->state = HANDLE_FINISHED;
@@ -129,22 +268,60 @@ void handle_read(Handle* handle, Buffer* buf) {
             }
             break;
             case HANDLE_SEND: {
-                int nread = 0;
+                if (handle->entry != NULL) {
+                    while (buffer_input_size(buf) > 0 && handle->res_content_length > 0) {
+                        int len = min(buffer_input_size(buf), handle->res_content_length);
+                        memcpy(buffer_input_ptr(buf), handle->entry->data + handle->entry_offset, len);
+                        handle->entry_offset += len;
+                        handle->res_content_length -= len;
+                        buffer_input(buf, len);
+                    }
+                    if (handle->res_content_length == 0) {
+                        handle->state = HANDLE_FINISHED;
+                    }
+                    return;
+                }
                 while (buffer_input_size(buf) > 0 && handle->res_content_length > 0) {
-                    nread = min(fread(buffer_input_ptr(buf), 1, buffer_input_size(buf), handle->file)
-                               ,handle->res_content_length);
-                    if (nread <= 0) {
+                    DiskJob* job = handle->job;
+                    if (job == NULL || handle->job_offset == job->len) {
+                        if (handle->file_offset - handle->dropped_offset >= DISKIO_DROP_WINDOW) {
+                            diskio_drop(handle->fd, handle->dropped_offset,
+                                        handle->file_offset - handle->dropped_offset, handle->file_size);
+                            handle->dropped_offset = handle->file_offset;
+                        }
+                        // the staged bytes are used up, read the next ones
+                        handle->job = job = diskio_read(job, handle->fd, handle->file_offset,
+                                                        handle->res_content_length);
+                        handle->job_offset = 0;
+                    }
+                    if (!diskio_done(job)) {
+                        handle->resume_state = HANDLE_SEND;
+                        handle->state = HANDLE_WAIT;
+                        return;
+                    }
+                    if (job->len <= 0) {
                         handle->state = HANDLE_FAILED;
                         return;
                     }
-                    handle->res_content_length -= nread;
-                    buffer_input(buf, nread);
+                    int len = min(min(buffer_input_size(buf), job->len - handle->job_offset),
+                                  handle->res_content_length);
+                    memcpy(buffer_input_ptr(buf), job->data + handle->job_offset, len);
+                    handle->job_offset += len;
+                    handle->file_offset += len;
+                    handle->res_content_length -= len;
+                    buffer_input(buf, len);
                 }
                 if (handle->res_content_length == 0) {
                     handle->state = HANDLE_FINISHED;
                 }
                 return;
             }
+            case HANDLE_WAIT: {
+                if (!handle_poll(handle)) {
+                    return;
+                }
+            }
+            break;
             default: {
                 log_(LOG_WARN, "handle_read is called when handle state isn't HANDLE_PROCESS or HANDLE_SEND\n");
                 return;
@@ -153,6 +330,14 @@ void handle_read(Handle* handle, Buffer* buf) {
     }
 }
 
+int handle_poll(Handle* handle) {
+    if (handle->state != HANDLE_WAIT || !diskio_done(handle->job)) {
+        return 0;
+    }
+    handle->state = handle->resume_state;
+    return 1;
+}
+
 void handle_write(Handle* handle, Buffer* buf) { 
     if (handle->state != HANDLE_RECV) {
         log_(LOG_WARN, "handle_read is called when handle state isn't HANDLE_RECV\n");
@@ -166,10 +351,33 @@ void handle_write(Handle* handle, Buffer* buf) {
     }
 }
 
+static void close_file(DiskJob* job, void* file) {
+    if (file != NULL) {
+        meta_release_file((MetaFile*) file);
+    } else {
+        close(job->fd);
+    }
+}
+
 void handle_destroy(Handle* handle) {
     request_destroy(handle->request);
     free(handle->request);
-    if (handle->file != NULL) {
-        fclose(handle->file);
-    } 
+    if (handle->file == NULL && handle->fd >= 0) {
+        diskio_drop(handle->fd, handle->dropped_offset, handle->file_offset - handle->dropped_offset,
+                    handle->file_size);
+    }
+    if (handle->fd >= 0 && handle->job != NULL && handle->job->type == DISKIO_READ) {
+        // a read still running keeps using the fd, it's closed once the thread is done
+        diskio_release_then(handle->job, close_file, handle->file);
+    } else {
+        diskio_release(handle->job);
+        if (handle->file != NULL) {
+            meta_release_file(handle->file);
+        } else if (handle->fd >= 0) {
+            close(handle->fd);
+        }
+    }
+    if (handle->entry != NULL) {
+        cache_release(handle->entry);
+    }
 }
\ No newline at end of file
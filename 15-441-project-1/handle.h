@@ -5,11 +5,19 @@
 
 #include "http.h"
 #include "buffer.h"
+#include "cache.h"
+#include "diskio.h"
+#include "meta.h"
+
+// the precompressed siblings of a static file, br, zstd and gzip
+#define HANDLE_NUM_ENCODINGS 3
 
 enum HandleState {
     HANDLE_RECV,
     HANDLE_PROCESS,
     HANDLE_SEND,
+    // waiting for the disk threads, then back to resume_state
+    HANDLE_WAIT,
     HANDLE_FAILED,
     HANDLE_FINISHED
 };
@@ -22,16 +30,43 @@ struct Handle {
     int req_content_length;
     int res_content_length;
     int last_req;
-    FILE* file;
+    int fd;
+    long long file_offset;
+    long long file_size;
+    // what's before it is dropped from the page cache already
+    long long dropped_offset;
+    // the open or stat of the file, then the read staging its next bytes
+    DiskJob* job;
+    int job_offset;
+    // of the metadata cache when the file was looked up
+    unsigned int meta_generation;
+    // the file fd belongs to when it's shared through the metadata cache
+    MetaFile* file;
+    // the encodings the client accepts, a bit each, and the one being served or tried,
+    // HANDLE_NUM_ENCODINGS for the file itself
+    int accepted;
+    int encoding;
+    CacheEntry* entry;
+    int entry_offset;
     HandleState state;
+    HandleState resume_state;
 };
 
 typedef struct Handle Handle;
 
+// serve the .br, .zst or .gz sibling of a static file to the clients accepting it
+void handle_set_precompressed(int enabled);
+
 void handle_init(Handle* handle, char* www_foler, Request* request);
 
+// send a complete response kept in the cache, the handle takes the reference
+void handle_init_cached(Handle* handle, Request* request, CacheEntry* entry);
+
 void handle_read(Handle* handle, Buffer* buf);
 
+// returns 1 once the disk job the handle waits for is done
+int handle_poll(Handle* handle);
+
 void handle_write(Handle* handle, Buffer* buf);
 
 void handle_destroy(Handle* handle);
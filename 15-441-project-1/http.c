@@ -85,9 +85,15 @@ void response_init(Response* response, StatusCode status_code) {
 		case NOT_IMPLEMENTED:
 			response->reason_phrase = new_str("Not Implemented");
 			break;
+		case BAD_GATEWAY:
+			response->reason_phrase = new_str("Bad Gateway");
+			break;
 		case SERVICE_UNAVAILABLE:
 			response->reason_phrase = new_str("Service Unavailable");
 			break;
+		case GATEWAY_TIMEOUT:
+			response->reason_phrase = new_str("Gateway Timeout");
+			break;
 		case HTTP_VERSION_NOT_SUPPORTED:
 			response->reason_phrase = new_str("HTTP Version not supported");
 			break;
@@ -11,7 +11,9 @@ enum StatusCode {
 	REQUEST_ENTITY_TOO_LARGE = 413,
 	INTERNAL_SERVER_ERROR = 500,
 	NOT_IMPLEMENTED = 501,
+	BAD_GATEWAY = 502,
 	SERVICE_UNAVAILABLE = 503,
+	GATEWAY_TIMEOUT = 504,
 	HTTP_VERSION_NOT_SUPPORTED = 505
 };
 
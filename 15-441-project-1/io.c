@@ -1,24 +1,33 @@
 #include <unistd.h>
 #include <stdio.h>
+#include <sys/select.h>
 
 #include "io.h"
 #include "utils.h"
+#include "trace.h"
 
 static int maxfd;
 static fd_set readfs;
 static fd_set writefs;
+static long long timeout_ms;
 
 void io_init() {
     maxfd = -1;
     FD_ZERO(&readfs);
     FD_ZERO(&writefs);
+    timeout_ms = -1;
 }
 
 void io_wait() {
-    if (maxfd == -1) {
+    if (maxfd == -1 && timeout_ms < 0) {
         return;
     }
-    int rv = select(maxfd + 1, &readfs, &writefs, NULL, NULL);
+    struct timeval timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
+    TRACE_BEGIN(span);
+    int rv = select(maxfd + 1, &readfs, &writefs, NULL, timeout_ms < 0 ? NULL : &timeout);
+    TRACE_END(span, "io_wait", maxfd);
     if (rv == -1) {
         perror("select");
     }
@@ -26,15 +35,31 @@ void io_wait() {
 }
 
 void io_need_read(int fd) {
+    // select can't watch it, the caller only polls it
+    if (fd < 0 || fd >= FD_SETSIZE) {
+        return;
+    }
     maxfd = max(maxfd, fd);
     FD_SET(fd, &readfs);
 }
 
 void io_need_write(int fd) {
+    if (fd < 0 || fd >= FD_SETSIZE) {
+        return;
+    }
     maxfd = max(maxfd, fd);
     FD_SET(fd, &writefs);
 }
 
+void io_need_timeout(long long ms) {
+    if (ms < 0) {
+        ms = 0;
+    }
+    if (timeout_ms < 0 || ms < timeout_ms) {
+        timeout_ms = ms;
+    }
+}
+
 int io_wait_read(int fd) {
     return FD_ISSET(fd, &readfs) > 0;
 }
@@ -9,6 +9,9 @@ void io_need_read(int fd);
 
 void io_need_write(int fd);
 
+// wake up io_wait after ms milliseconds even if no fd is ready
+void io_need_timeout(long long ms);
+
 int io_wait_read(int fd);
 
 int io_wait_write(int fd);
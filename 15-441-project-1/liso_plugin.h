@@ -0,0 +1,53 @@
+#ifndef __LISO_PLUGIN_H__
+#define __LISO_PLUGIN_H__
+
+/*
+ * ABI of native request handlers. A handler is a shared object exporting
+ *
+ *     const LisoPlugin liso_plugin = {LISO_PLUGIN_ABI_VERSION, ...};
+ *
+ * lisod loads it at startup, registers it on a path prefix and drives it from
+ * the event loop like its own static file handler: the request body is fed
+ * through write() and the response, status line and headers included, is
+ * pulled through read(). Callbacks run on the event loop and must not block.
+ */
+
+#define LISO_PLUGIN_ABI_VERSION 1
+
+#define LISO_PLUGIN_SYMBOL "liso_plugin"
+
+struct LisoPluginRequest {
+    const char* http_method;
+    const char* http_version;
+    const char* abs_path;
+    const char* query;
+    const char* remote_addr;
+    int content_length;
+    int is_tls;
+    // returns NULL if the header isn't present
+    const char* (*get_header)(const struct LisoPluginRequest* request, const char* name);
+    void* host;
+};
+
+typedef struct LisoPluginRequest LisoPluginRequest;
+
+struct LisoPlugin {
+    int abi_version;
+    const char* name;
+    // called once after loading, returns 0 to refuse the registration, may be NULL
+    int (*init)(const char* prefix);
+    // called for every request, returns the per-request context or NULL on failure
+    void* (*create)(const LisoPluginRequest* request);
+    // consumes between 1 and size bytes of the request body, returns the number consumed or -1
+    int (*write)(void* ctx, const char* data, int size);
+    // produces at most size bytes of the response, returns the number produced,
+    // 0 once the response is complete or -1
+    int (*read)(void* ctx, char* buf, int size);
+    void (*destroy)(void* ctx);
+    // called once before unloading, may be NULL
+    void (*cleanup)(void);
+};
+
+typedef struct LisoPlugin LisoPlugin;
+
+#endif
@@ -5,11 +5,27 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <getopt.h>
 
 #include "io.h"
 #include "pool.h"
 #include "utils.h"
 #include "log.h"
+#include "zygote.h"
+#include "cgi_pool.h"
+#include "plugin.h"
+#include "upstream.h"
+#include "metrics.h"
+#include "admin.h"
+#include "probes.h"
+#include "overload.h"
+#include "diskio.h"
+#include "meta.h"
+#include "trace.h"
+
+#define MAX_PLUGINS 16
+#define MAX_UPSTREAMS 16
 
 struct {
     int http_port;
@@ -20,12 +36,96 @@ struct {
     char *cgi_script;
     char *key_file;
     char *crt_file;
+    char *cgi_zygote;
+    int cgi_max_procs;
+    int cgi_queue_timeout;
+    int cgi_timeout;
+    int cgi_spool_threshold;
+    char *plugins[MAX_PLUGINS];
+    int num_plugins;
+    int cgi_cache_ttl;
+    int cgi_cache_size;
+    char *cgi_cache_vary;
+    int cgi_coalesce;
+    char *upstreams[MAX_UPSTREAMS];
+    int num_upstreams;
+    int proxy_timeout;
+    int proxy_max_fails;
+    int proxy_fail_timeout;
+    int proxy_slow_start;
+    LogOverflow log_overflow;
+    LogLevel log_level;
+    char *access_log;
+    int access_log_sample;
+    char *metrics_path;
+    char *admin_socket;
+    char *trace_file;
+    int shed_lag;
+    int turn_bytes;
+    int shortest_first;
+    int disk_threads;
+    long long drop_cache_size;
+    int meta_cache_entries;
+    int fd_cache_entries;
+    int precompressed;
 } options;
 
+static struct option long_options[] = {
+        {"cgi-zygote", required_argument, NULL, 'z'},
+        {"cgi-max-procs", required_argument, NULL, 'p'},
+        {"cgi-queue-timeout", required_argument, NULL, 'q'},
+        {"cgi-timeout", required_argument, NULL, 't'},
+        {"cgi-spool-threshold", required_argument, NULL, 's'},
+        {"plugin", required_argument, NULL, 'l'},
+        {"cgi-cache-ttl", required_argument, NULL, 'c'},
+        {"cgi-cache-size", required_argument, NULL, 'C'},
+        {"cgi-cache-vary", required_argument, NULL, 'v'},
+        {"cgi-coalesce", no_argument, NULL, 'm'},
+        {"proxy", required_argument, NULL, 'u'},
+        {"proxy-timeout", required_argument, NULL, 'T'},
+        {"proxy-max-fails", required_argument, NULL, 'F'},
+        {"proxy-fail-timeout", required_argument, NULL, 'E'},
+        {"proxy-slow-start", required_argument, NULL, 'S'},
+        {"log-overflow", required_argument, NULL, 'o'},
+        {"log-level", required_argument, NULL, 'L'},
+        {"access-log", required_argument, NULL, 'a'},
+        {"access-log-sample", required_argument, NULL, 'A'},
+        {"metrics-path", required_argument, NULL, 'M'},
+        {"admin-socket", required_argument, NULL, 'I'},
+        {"trace", required_argument, NULL, 'x'},
+        {"shed-lag", required_argument, NULL, 'g'},
+        {"turn-bytes", required_argument, NULL, 'b'},
+        {"shortest-first", no_argument, NULL, 'f'},
+        {"disk-threads", required_argument, NULL, 'd'},
+        {"drop-cache-size", required_argument, NULL, 'D'},
+        {"meta-cache-entries", required_argument, NULL, 'n'},
+        {"fd-cache-entries", required_argument, NULL, 'O'},
+        {"precompressed", no_argument, NULL, 'P'},
+        {NULL, 0, NULL, 0}
+};
+
 Pool pool;
 
+// set by SIGTERM, the loop finishes its iteration and shuts down
+static volatile sig_atomic_t terminating = 0;
+// set by SIGUSR1, the trace is written out after the iteration
+static volatile sig_atomic_t trace_requested = 0;
+
 void lisod_shutdown(int exit_stat) {
     pool_destroy(&pool);
+    // the disk threads trace and log, they stop before anything they touch is freed
+    diskio_cleanup();
+    plugin_cleanup();
+    upstream_cleanup();
+    cache_cleanup();
+    cgi_pool_cleanup();
+    access_log_cleanup();
+    metrics_cleanup();
+    admin_cleanup();
+    trace_cleanup();
+    overload_cleanup();
+    meta_cleanup();
+    zygote_cleanup();
     log_cleanup();
     exit(exit_stat);
 }
@@ -36,8 +136,12 @@ void signal_handler(int sig) {
             /* rehash the server */
             break;
         case SIGTERM:
+        case SIGINT:
             /* finalize and shutdown the server */
-            lisod_shutdown(EXIT_SUCCESS);
+            terminating = 1;
+            break;
+        case SIGUSR1:
+            trace_requested = 1;
             break;
         default:
             break;
@@ -83,42 +187,245 @@ int daemonize(const char *lock_file) {
 }
 
 int parse_options(int argc, char *argv[]) {
-    if (argc != 9) {
+    int opt;
+    options.cgi_zygote = NULL;
+    options.cgi_max_procs = CGI_POOL_DEFAULT_MAX_PROCS;
+    options.cgi_queue_timeout = CGI_POOL_DEFAULT_QUEUE_TIMEOUT;
+    options.cgi_timeout = CGI_POOL_DEFAULT_RUN_TIMEOUT;
+    options.cgi_spool_threshold = 0;
+    options.num_plugins = 0;
+    options.cgi_cache_ttl = 0;
+    options.cgi_cache_size = CACHE_DEFAULT_MAX_SIZE;
+    options.cgi_cache_vary = CGI_CACHE_DEFAULT_VARY;
+    options.cgi_coalesce = 0;
+    options.num_upstreams = 0;
+    options.proxy_timeout = PROXY_DEFAULT_TIMEOUT;
+    options.proxy_max_fails = UPSTREAM_DEFAULT_MAX_FAILS;
+    options.proxy_fail_timeout = UPSTREAM_DEFAULT_FAIL_TIMEOUT;
+    options.proxy_slow_start = UPSTREAM_DEFAULT_SLOW_START;
+    options.log_overflow = LOG_DROP;
+    options.log_level = LOG_DEBUG;
+    options.access_log = NULL;
+    options.access_log_sample = 1;
+    options.metrics_path = NULL;
+    options.admin_socket = NULL;
+    options.trace_file = NULL;
+    options.shed_lag = 0;
+    options.turn_bytes = CONN_DEFAULT_TURN_BYTES;
+    options.shortest_first = 0;
+    options.disk_threads = DISKIO_DEFAULT_THREADS;
+    options.drop_cache_size = DISKIO_DEFAULT_DROP_SIZE;
+    options.meta_cache_entries = META_DEFAULT_MAX_ENTRIES;
+    options.fd_cache_entries = META_DEFAULT_MAX_FILES;
+    options.precompressed = 0;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'z':
+                options.cgi_zygote = optarg;
+                break;
+            case 'p':
+                options.cgi_max_procs = atoi(optarg);
+                break;
+            case 'q':
+                options.cgi_queue_timeout = atoi(optarg);
+                break;
+            case 't':
+                options.cgi_timeout = atoi(optarg);
+                break;
+            case 's':
+                options.cgi_spool_threshold = atoi(optarg);
+                break;
+            case 'l':
+                if (options.num_plugins == MAX_PLUGINS) {
+                    return 0;
+                }
+                options.plugins[options.num_plugins++] = optarg;
+                break;
+            case 'c':
+                options.cgi_cache_ttl = atoi(optarg);
+                break;
+            case 'C':
+                options.cgi_cache_size = atoi(optarg);
+                break;
+            case 'v':
+                options.cgi_cache_vary = optarg;
+                break;
+            case 'm':
+                options.cgi_coalesce = 1;
+                break;
+            case 'u':
+                if (options.num_upstreams == MAX_UPSTREAMS) {
+                    return 0;
+                }
+                options.upstreams[options.num_upstreams++] = optarg;
+                break;
+            case 'T':
+                options.proxy_timeout = atoi(optarg);
+                break;
+            case 'F':
+                options.proxy_max_fails = atoi(optarg);
+                break;
+            case 'E':
+                options.proxy_fail_timeout = atoi(optarg);
+                break;
+            case 'S':
+                options.proxy_slow_start = atoi(optarg);
+                break;
+            case 'o':
+                if (!strcmp(optarg, "drop")) {
+                    options.log_overflow = LOG_DROP;
+                } else if (!strcmp(optarg, "block")) {
+                    options.log_overflow = LOG_BLOCK;
+                } else {
+                    return 0;
+                }
+                break;
+            case 'L':
+                if (!strcmp(optarg, "debug")) {
+                    options.log_level = LOG_DEBUG;
+                } else if (!strcmp(optarg, "info")) {
+                    options.log_level = LOG_INFO;
+                } else if (!strcmp(optarg, "warn")) {
+                    options.log_level = LOG_WARN;
+                } else if (!strcmp(optarg, "error")) {
+                    options.log_level = LOG_ERROR;
+                } else {
+                    return 0;
+                }
+                break;
+            case 'a':
+                options.access_log = optarg;
+                break;
+            case 'A':
+                options.access_log_sample = atoi(optarg);
+                break;
+            case 'M':
+                options.metrics_path = optarg;
+                break;
+            case 'I':
+                options.admin_socket = optarg;
+                break;
+            case 'x':
+                options.trace_file = optarg;
+                break;
+            case 'g':
+                options.shed_lag = atoi(optarg);
+                break;
+            case 'b':
+                options.turn_bytes = atoi(optarg);
+                break;
+            case 'f':
+                options.shortest_first = 1;
+                break;
+            case 'd':
+                options.disk_threads = atoi(optarg);
+                break;
+            case 'D':
+                options.drop_cache_size = atoll(optarg);
+                break;
+            case 'n':
+                options.meta_cache_entries = atoi(optarg);
+                break;
+            case 'O':
+                options.fd_cache_entries = atoi(optarg);
+                break;
+            case 'P':
+                options.precompressed = 1;
+                break;
+            default:
+                return 0;
+        }
+    }
+    if (argc - optind != 8) {
         return 0;
     }
-    options.http_port = atoi(argv[1]);
-    options.https_port = atoi(argv[2]);
-    options.log_file = argv[3];
-    options.lock_file = argv[4];
-    options.www_folder = argv[5];
-    options.cgi_script = argv[6];
-    options.key_file = argv[7];
-    options.crt_file = argv[8];
+    argv += optind;
+    options.http_port = atoi(argv[0]);
+    options.https_port = atoi(argv[1]);
+    options.log_file = argv[2];
+    options.lock_file = argv[3];
+    options.www_folder = argv[4];
+    options.cgi_script = argv[5];
+    options.key_file = argv[6];
+    options.crt_file = argv[7];
     return is_valid_port(options.http_port) && is_valid_port(options.https_port);
 }
 
 void handle_conn(Conn *conn) {
     log_(LOG_DEBUG, "Handling connection: sockfd = %d\n", conn->sockfd);
+    // only read by the probe, the compiler drops it when probes are off
+    ConnState last_state = conn->state;
+    int steps = 0;
+    conn->turn_bytes = 0;
     while (1) {
+        if (conn->state != last_state) {
+            PROBE3(conn_state, conn->sockfd, last_state, conn->state);
+            last_state = conn->state;
+        }
+        if (conn->state != CONN_CLOSE && (++steps > CONN_TURN_MAX_STEPS
+                                          || (options.turn_bytes > 0 && conn->turn_bytes >= options.turn_bytes))) {
+            // out of budget, the connection is run again right after the io wait
+            conn->requeued = 1;
+            io_need_timeout(0);
+            return;
+        }
         switch (conn->state) {
             case RECV_REQ_HEAD: {
                 log_(LOG_DEBUG, "Connection state is RECV_REQ_HEAD\n");
+                TRACE_BEGIN(span);
                 Request *request = parser_parse(&(conn->parser), &(conn->in_buf));
+                TRACE_END(span, "parse", conn->sockfd);
                 if (request != NULL) {
                     log_(LOG_INFO, "handle request: %s %s %s\n", request->http_method, request->abs_path,
                          request->http_version);
-                    if (cgi_can_handle(request)) {
+                    PROBE3(request, conn->sockfd, request->http_method, request->abs_path);
+                    conn_begin_request(conn, request);
+                    const PluginEntry *plugin_entry = plugin_match(request);
+                    UpstreamGroup *group;
+                    CacheEntry *entry;
+                    if (metrics_match(request, conn->addr)) {
+                        conn->handle = (Handle *) malloc(sizeof(Handle));
+                        handle_init_cached(conn->handle, request, metrics_scrape(pool.num_conns, pool.max_conns));
+                        conn->state = SEND_RES;
+                    } else if (overload_active()) {
+                        conn->handle = (Handle *) malloc(sizeof(Handle));
+                        handle_init_cached(conn->handle, request, overload_response());
+                        conn->handle->last_req = 1;
+                        conn->state = SEND_RES;
+                    } else if (plugin_entry != NULL) {
+                        conn->route = METRICS_PLUGIN;
+                        conn->plugin = (Plugin *) malloc(sizeof(Plugin));
+                        plugin_init(conn->plugin, plugin_entry, request, conn->addr, conn->ssl != NULL);
+                        conn->state = PLUGIN_RECV_REQ_BODY;
+                    } else if ((group = upstream_match(request)) != NULL) {
+                        conn->route = METRICS_PROXY;
+                        conn->proxy = (Proxy *) malloc(sizeof(Proxy));
+                        proxy_init(conn->proxy, group, request, conn->addr, conn->ssl != NULL);
+                        conn->state = PROXY_RECV_REQ_BODY;
+                    } else if (cgi_can_handle(request) && (entry = cgi_cache_lookup(request)) != NULL) {
+                        conn->route = METRICS_CGI;
+                        conn->handle = (Handle *) malloc(sizeof(Handle));
+                        handle_init_cached(conn->handle, request, entry);
+                        conn->state = SEND_RES;
+                    } else if (cgi_can_handle(request)) {
+                        conn->route = METRICS_CGI;
+                        PROBE2(cgi_start, conn->sockfd, request->abs_path);
                         conn->cgi = (Cgi *) malloc(sizeof(Cgi));
                         cgi_init(conn->cgi, options.cgi_script, request, conn->addr,
                                  conn->ssl == NULL ? options.http_port : options.https_port, conn->ssl != NULL);
                         conn->state = CGI_RECV_REQ_BODY;
                     } else {
+                        PROBE2(handle_start, conn->sockfd, request->abs_path);
                         conn->handle = (Handle *) malloc(sizeof(Handle));
                         handle_init(conn->handle, options.www_folder, request);
                         conn->state = RECV_REQ_BODY;
                     }
                 } else if (conn->parser.state == STATE_FAILED) {
                     conn->state = CONN_CLOSE;
+                } else if (overload_active() && conn->parser.buf_len == 0 && buffer_is_empty(&(conn->in_buf))
+                           && get_monotonic_time_us() - conn->last_io_at > OVERLOAD_IDLE_TIMEOUT * 1000LL) {
+                    // an idle keep-alive connection
+                    conn->state = CONN_CLOSE;
                 } else if (!conn_recv(conn)) {
                     return;
                 }
@@ -139,16 +446,22 @@ void handle_conn(Conn *conn) {
                 log_(LOG_DEBUG, "Connection state is SEND_RES\n");
                 if (conn->handle->state == HANDLE_FAILED) {
                     conn->state = CONN_CLOSE;
+                } else if (conn->handle->state == HANDLE_WAIT && !handle_poll(conn->handle)) {
+                    // the file is opened or read by the disk threads meanwhile
+                    if (buffer_is_empty(&(conn->out_buf)) || !conn_send(conn)) {
+                        return;
+                    }
                 } else if (!buffer_is_full(&(conn->out_buf))
                            && (conn->handle->state == HANDLE_PROCESS || conn->handle->state == HANDLE_SEND)) {
                     handle_read(conn->handle, &(conn->out_buf));
                 } else if (buffer_is_empty(&(conn->out_buf)) && conn->handle->state == HANDLE_FINISHED) {
-                    if (conn->handle->last_req) {
+                    if (conn->handle->last_req || overload_active()) {
                         conn->state = CONN_CLOSE;
                     } else {
                         handle_destroy(conn->handle);
                         free(conn->handle);
                         conn->handle = NULL;
+                        conn_end_request(conn);
                         parser_init(&(conn->parser));
                         conn->state = RECV_REQ_HEAD;
                     }
@@ -159,8 +472,27 @@ void handle_conn(Conn *conn) {
                 break;
             case CGI_RECV_REQ_BODY: {
                 log_(LOG_DEBUG, "Connection state is CGI_RECV_REQ_BODY\n");
-                if (conn->cgi->state != CGI_RECV) {
+                if (conn->cgi->state == CGI_SPOOL) {
+                    if (!buffer_is_empty(&(conn->in_buf))) {
+                        cgi_spool(conn->cgi, &(conn->in_buf));
+                    } else if (!conn_recv(conn)) {
+                        return;
+                    }
+                } else if (conn->cgi->state == CGI_QUEUED) {
+                    if (!cgi_schedule(conn->cgi)) {
+                        return;
+                    }
+                } else if (conn->cgi->state != CGI_RECV) {
                     conn->state = CGI_SEND_RES;
+                } else if (conn->cgi->use_splice) {
+                    // write out the buffered part of the body first, then splice the rest
+                    long long spliced = 0;
+                    if (!(buffer_is_empty(&(conn->in_buf))
+                          ? cgi_splice_write(conn->cgi, conn->sockfd, &spliced)
+                          : cgi_write(conn->cgi, &(conn->in_buf)))) {
+                        return;
+                    }
+                    conn_account(conn, spliced, 0);
                 } else if (!conn_recv(conn)
                            && (buffer_is_empty(&(conn->in_buf)) || !cgi_write(conn->cgi, &(conn->in_buf)))) {
                     return;
@@ -171,17 +503,108 @@ void handle_conn(Conn *conn) {
                 log_(LOG_DEBUG, "Connection state is CGI_SEND_RES\n");
                 if (conn->cgi->state == CGI_FAILED) {
                     conn->state = CONN_CLOSE;
+                } else if (conn->cgi->state == CGI_QUEUED) {
+                    // the coalesced request has to run the script on its own
+                    conn->state = CGI_RECV_REQ_BODY;
+                } else if (conn->cgi->state == CGI_REDIRECT) {
+                    // serve the file named by the script through the static path
+                    conn->handle = (Handle *) malloc(sizeof(Handle));
+                    handle_init(conn->handle, options.www_folder, cgi_redirect_request(conn->cgi));
+                    cgi_destroy(conn->cgi);
+                    free(conn->cgi);
+                    conn->cgi = NULL;
+                    conn->state = SEND_RES;
                 } else if (buffer_is_empty(&(conn->out_buf)) && conn->cgi->state == CGI_FINISHED) {
-                    if (request_connection_close(conn->cgi->request)) {
+                    if (conn->cgi->last_req || overload_active()) {
                         conn->state = CONN_CLOSE;
                     } else {
                         cgi_destroy(conn->cgi);
                         free(conn->cgi);
                         conn->cgi = NULL;
+                        conn_end_request(conn);
                         parser_init(&(conn->parser));
                         conn->state = RECV_REQ_HEAD;
                     }
-                } else if ((conn->cgi->state != CGI_SEND || !cgi_read(conn->cgi, &(conn->out_buf)))
+                } else if (cgi_can_splice(conn->cgi) && buffer_is_empty(&(conn->out_buf))) {
+                    long long spliced = 0;
+                    if (!cgi_splice_read(conn->cgi, conn->sockfd, &spliced)) {
+                        return;
+                    }
+                    conn_account(conn, 0, spliced);
+                } else if (((conn->cgi->state != CGI_SEND && conn->cgi->state != CGI_ERROR
+                             && conn->cgi->state != CGI_WAIT)
+                            || buffer_is_full(&(conn->out_buf)) || !cgi_read(conn->cgi, &(conn->out_buf)))
+                           && (buffer_is_empty(&(conn->out_buf)) || !conn_send(conn))) {
+                    return;
+                }
+            }
+                break;
+            case PLUGIN_RECV_REQ_BODY: {
+                log_(LOG_DEBUG, "Connection state is PLUGIN_RECV_REQ_BODY\n");
+                if (conn->plugin->state != PLUGIN_RECV) {
+                    conn->state = PLUGIN_SEND_RES;
+                } else if (!buffer_is_empty(&(conn->in_buf))) {
+                    plugin_write(conn->plugin, &(conn->in_buf));
+                } else if (!conn_recv(conn)) {
+                    return;
+                }
+            }
+                break;
+            case PLUGIN_SEND_RES: {
+                log_(LOG_DEBUG, "Connection state is PLUGIN_SEND_RES\n");
+                if (conn->plugin->state == PLUGIN_FAILED) {
+                    conn->state = CONN_CLOSE;
+                } else if (!buffer_is_full(&(conn->out_buf)) && conn->plugin->state == PLUGIN_SEND) {
+                    plugin_read(conn->plugin, &(conn->out_buf));
+                } else if (buffer_is_empty(&(conn->out_buf)) && conn->plugin->state == PLUGIN_FINISHED) {
+                    if (conn->plugin->last_req || overload_active()) {
+                        conn->state = CONN_CLOSE;
+                    } else {
+                        plugin_destroy(conn->plugin);
+                        free(conn->plugin);
+                        conn->plugin = NULL;
+                        conn_end_request(conn);
+                        parser_init(&(conn->parser));
+                        conn->state = RECV_REQ_HEAD;
+                    }
+                } else if (!conn_send(conn)) {
+                    return;
+                }
+            }
+                break;
+            case PROXY_RECV_REQ_BODY: {
+                log_(LOG_DEBUG, "Connection state is PROXY_RECV_REQ_BODY\n");
+                if (conn->proxy->state != PROXY_CONNECT && conn->proxy->state != PROXY_SEND) {
+                    conn->state = PROXY_SEND_RES;
+                } else if (proxy_need_body(conn->proxy) && buffer_is_empty(&(conn->in_buf))) {
+                    if (!conn_recv(conn)) {
+                        return;
+                    }
+                } else if (!proxy_write(conn->proxy, &(conn->in_buf))) {
+                    return;
+                }
+            }
+                break;
+            case PROXY_SEND_RES: {
+                log_(LOG_DEBUG, "Connection state is PROXY_SEND_RES\n");
+                if (conn->proxy->state == PROXY_FAILED) {
+                    conn->state = CONN_CLOSE;
+                } else if (conn->proxy->state == PROXY_CONNECT || conn->proxy->state == PROXY_SEND) {
+                    // the request is sent again on a fresh upstream connection
+                    conn->state = PROXY_RECV_REQ_BODY;
+                } else if (buffer_is_empty(&(conn->out_buf)) && conn->proxy->state == PROXY_FINISHED) {
+                    if (conn->proxy->last_req || overload_active()) {
+                        conn->state = CONN_CLOSE;
+                    } else {
+                        proxy_destroy(conn->proxy);
+                        free(conn->proxy);
+                        conn->proxy = NULL;
+                        conn_end_request(conn);
+                        parser_init(&(conn->parser));
+                        conn->state = RECV_REQ_HEAD;
+                    }
+                } else if (((conn->proxy->state != PROXY_RECV && conn->proxy->state != PROXY_ERROR)
+                            || buffer_is_full(&(conn->out_buf)) || !proxy_read(conn->proxy, &(conn->out_buf)))
                            && (buffer_is_empty(&(conn->out_buf)) || !conn_send(conn))) {
                     return;
                 }
@@ -199,7 +622,51 @@ void handle_conn(Conn *conn) {
 int main(int argc, char *argv[]) {
     if (!parse_options(argc, argv)) {
         fprintf(stdout,
-                "usage: ./lisod <HTTP port> <HTTPS port> <log file> <lock file> <www folder> <CGI script path> <private key file> <certificate file>\n");
+                "usage: ./lisod <HTTP port> <HTTPS port> <log file> <lock file> <www folder> <CGI script path> <private key file> <certificate file> [options]\n"
+                "options:\n"
+                "  --cgi-zygote <helper>       run cgi requests through a pre-warmed fork server, e.g. ./cgi_zygote.py\n"
+                "  --cgi-max-procs <n>         maximum number of running cgi processes, 0 for no limit (default 32)\n"
+                "  --cgi-queue-timeout <ms>    answer 503 after waiting this long for a cgi process (default 5000)\n"
+                "  --cgi-timeout <ms>          kill cgi processes running longer than this, 0 for no limit (default 30000)\n"
+                "  --cgi-spool-threshold <n>   buffer cgi request bodies larger than n bytes before starting the\n"
+                "                              script, in memory up to 64 MB in total, then in /tmp, 0 to disable\n"
+                "                              (default 0)\n"
+                "  --plugin <prefix>=<path>    serve a path prefix with a native handler, may be repeated\n"
+                "  --cgi-cache-ttl <ms>        cache GET/HEAD cgi responses for this long, 0 to disable (default 0)\n"
+                "  --cgi-cache-size <n>        maximum bytes held by the cgi response cache (default 16M)\n"
+                "  --cgi-cache-vary <headers>  comma separated request headers added to the cache key (default Cookie)\n"
+                "  --cgi-coalesce              let identical concurrent GET/HEAD cgi requests share one script run\n"
+                "  --proxy <prefix>=<group>    forward a path prefix to a group of http upstreams, may be repeated,\n"
+                "                              group is [round-robin|least-conn|hash@]host:port[,host:port...]\n"
+                "  --proxy-timeout <ms>        fail proxied requests whose upstream stalls this long, 0 for no limit\n"
+                "                              (default 30000)\n"
+                "  --proxy-max-fails <n>       eject an upstream after n failures in a row, 0 to never (default 3)\n"
+                "  --proxy-fail-timeout <ms>   how long an ejected upstream is skipped (default 10000)\n"
+                "  --proxy-slow-start <ms>     ramp the traffic of a recovered upstream up over this long (default 10000)\n"
+                "  --log-overflow drop|block   drop log records or wait for the log writer when it falls behind\n"
+                "                              (default drop)\n"
+                "  --log-level <level>         debug, info, warn or error, levels compiled out by the build\n"
+                "                              are never logged (default debug)\n"
+                "  --access-log <file>         append a JSON line with the status, sizes and timings of every request\n"
+                "  --access-log-sample <n>     only log one request in n (default 1)\n"
+                "  --metrics-path <path>       serve counters and latency quantiles on path to loopback clients\n"
+                "  --admin-socket <path>       dump the connection table to clients of this unix socket\n"
+                "  --trace <file>              record event loop spans, written to file as a Chrome trace on SIGUSR1\n"
+                "  --shed-lag <ms>             stop accepting, answer 503 and close keep-alive connections while\n"
+                "                              the event loop lags this much behind, 0 to never shed (default 0)\n"
+                "  --turn-bytes <n>            bytes a connection may move before the others get their turn,\n"
+                "                              0 for no limit (default 256K)\n"
+                "  --shortest-first            give connections with the least response left their turn first\n"
+                "  --disk-threads <n>          threads opening and reading static files which aren't in the page\n"
+                "                              cache, 0 to do it on the event loop (default 4)\n"
+                "  --drop-cache-size <n>       drop files of at least n bytes from the page cache as they're sent,\n"
+                "                              0 to never (default 64M)\n"
+                "  --meta-cache-entries <n>    static paths whose lookup is remembered until the www folder\n"
+                "                              changes, 0 to disable (default 4096)\n"
+                "  --fd-cache-entries <n>      static files kept open for the GETs of their cached path,\n"
+                "                              0 to close each after its request (default 256)\n"
+                "  --precompressed             serve the .br, .zst or .gz sibling of a static file to clients\n"
+                "                              accepting it, see ./precompress.py\n");
         exit(EXIT_FAILURE);
     }
 //    if (daemonize(options.lock_file) == EXIT_FAILURE) {
@@ -207,21 +674,84 @@ int main(int argc, char *argv[]) {
 //    }
     fprintf(stdout, "----- Lisod Server -----\n");
     io_init();
-    log_init(LOG_DEBUG, options.log_file);
+    log_set_overflow(options.log_overflow);
+    log_init(options.log_level, options.log_file);
+    if (!access_log_init(options.access_log, options.access_log_sample)) {
+        fprintf(stdout, "Failed to open the access log %s\n", options.access_log);
+        exit(EXIT_FAILURE);
+    }
+    metrics_init(options.metrics_path);
+    trace_init(options.trace_file);
+    overload_init(options.shed_lag);
+    diskio_set_drop_size(options.drop_cache_size);
+    if (!diskio_init(options.disk_threads)) {
+        fprintf(stdout, "Failed to start the disk threads, see the log file\n");
+        exit(EXIT_FAILURE);
+    }
+    if (!meta_init(options.www_folder, options.meta_cache_entries, options.fd_cache_entries)) {
+        fprintf(stdout, "Failed to watch the www folder, see the log file\n");
+        exit(EXIT_FAILURE);
+    }
+    if (!admin_init(options.admin_socket)) {
+        fprintf(stdout, "Failed to open the admin socket %s\n", options.admin_socket);
+        exit(EXIT_FAILURE);
+    }
+    if (options.cgi_zygote != NULL && !zygote_init(options.cgi_zygote, options.cgi_script)) {
+        log_(LOG_WARN, "Failed to start the cgi zygote, cgi scripts will be forked directly\n");
+    }
+    int i;
+    for (i = 0; i != options.num_plugins; ++i) {
+        if (!plugin_load(options.plugins[i])) {
+            fprintf(stdout, "Failed to load plugin %s, see the log file\n", options.plugins[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (i = 0; i != options.num_upstreams; ++i) {
+        if (!upstream_add(options.upstreams[i])) {
+            fprintf(stdout, "Failed to add upstream %s, see the log file\n", options.upstreams[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    proxy_set_timeout(options.proxy_timeout);
+    upstream_set_health(options.proxy_max_fails, options.proxy_fail_timeout, options.proxy_slow_start);
+    handle_set_precompressed(options.precompressed);
+    cgi_set_spool_threshold(options.cgi_spool_threshold);
+    cgi_set_cache(options.cgi_cache_ttl, options.cgi_cache_vary);
+    cache_init(options.cgi_cache_size);
+    cgi_set_coalesce(options.cgi_coalesce);
+    cgi_pool_init(options.cgi_max_procs, options.cgi_queue_timeout, options.cgi_timeout);
     pool_init(&pool, FD_SETSIZE);
     pool_start(&pool, options.http_port, options.https_port, options.key_file, options.crt_file);
+    // buffered logs must be flushed on exit, SIGUSR1 dumps the trace
+    signal(SIGTERM, signal_handler);
+    signal(SIGINT, signal_handler);
+    signal(SIGUSR1, signal_handler);
     /* finally, loop waiting for input and then write it back */
-    while (1) {
+    while (!terminating) {
         log_(LOG_DEBUG, "The pool start handling connections\n");
-        Conn *p = pool.conns;
-        while (p != NULL) {
-            Conn *conn = p;
-            p = p->next;
+        int i, n = pool_schedule(&pool, options.shortest_first);
+        for (i = 0; i != n; ++i) {
+            Conn *conn = pool.run_queue[i];
             // conn may be removed
+            int sockfd = conn->sockfd;
+            TRACE_BEGIN(span);
             handle_conn(conn);
+            TRACE_END(span, "handle_conn", sockfd);
         }
+        admin_poll(&pool);
+        overload_end_iteration();
         pool_wait_io(&pool);
+        overload_begin_iteration();
+        diskio_poll();
+        meta_poll();
+        cgi_pool_reap();
+        access_log_tick();
+        upstream_tick();
+        if (trace_requested) {
+            trace_requested = 0;
+            trace_dump();
+        }
     }
-
+    lisod_shutdown(EXIT_SUCCESS);
     return EXIT_SUCCESS;
 }
@@ -1,50 +1,226 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdarg.h>
 #include <assert.h>
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include "log.h"
 
-static FILE* log_file;
+/*
+ * Records are formatted by the logging thread into a single producer,
+ * single consumer ring of its own and written to the file by a background
+ * thread, so log_ never takes a lock nor makes a system call.
+ */
+struct LogRecord {
+	int len;
+	char data[LOG_RECORD_SIZE - sizeof(int)];
+};
 
-static LogLevel log_level;
+typedef struct LogRecord LogRecord;
+
+struct LogRing {
+	LogRecord records[LOG_RING_SLOTS];
+	// head is only written by the writer thread, tail by the owner of the ring
+	atomic_uint head;
+	atomic_uint tail;
+	atomic_uint dropped;
+	struct LogRing* next;
+};
+
+typedef struct LogRing LogRing;
+
+static int log_fd = -1;
+
+// a forked child exiting mustn't wait for a writer it doesn't have
+static pid_t log_pid;
+
+LogLevel log_level;
+
+static LogOverflow log_overflow = LOG_DROP;
+
+static _Atomic(LogRing*) rings;
+
+static __thread LogRing* thread_ring;
+
+// formatting the date is only done once a second per thread
+static __thread time_t thread_time_sec = -1;
+static __thread char thread_time_str[64];
+static __thread int thread_time_len;
+
+static pthread_t writer;
+
+static atomic_int running;
+
+static char batch[LOG_BATCH_SIZE];
+
+static LogRing* ring_get() {
+	if (thread_ring == NULL) {
+		LogRing* ring = (LogRing*) calloc(1, sizeof(LogRing));
+		ring->next = atomic_load(&rings);
+		while (!atomic_compare_exchange_weak(&rings, &(ring->next), ring));
+		thread_ring = ring;
+	}
+	return thread_ring;
+}
+
+static void write_all(const char* data, int len) {
+	while (len > 0) {
+		int ret = write(log_fd, data, len);
+		if (ret <= 0) {
+			return;
+		}
+		data += ret;
+		len -= ret;
+	}
+}
+
+// moves everything available to the file, returns the number of records written
+static int drain() {
+	int batch_len = 0;
+	int count = 0;
+	LogRing* ring;
+	for (ring = atomic_load(&rings); ring != NULL; ring = ring->next) {
+		unsigned int dropped = atomic_exchange(&(ring->dropped), 0);
+		if (dropped > 0) {
+			char note[64];
+			int len = snprintf(note, sizeof(note), "... %u log record(s) dropped\n", dropped);
+			if (batch_len + len > LOG_BATCH_SIZE) {
+				write_all(batch, batch_len);
+				batch_len = 0;
+			}
+			memcpy(batch + batch_len, note, len);
+			batch_len += len;
+		}
+		unsigned int head = atomic_load_explicit(&(ring->head), memory_order_relaxed);
+		unsigned int tail = atomic_load_explicit(&(ring->tail), memory_order_acquire);
+		while (head != tail) {
+			LogRecord* record = &(ring->records[head % LOG_RING_SLOTS]);
+			if (batch_len + record->len > LOG_BATCH_SIZE) {
+				write_all(batch, batch_len);
+				batch_len = 0;
+			}
+			memcpy(batch + batch_len, record->data, record->len);
+			batch_len += record->len;
+			++head;
+			++count;
+			atomic_store_explicit(&(ring->head), head, memory_order_release);
+		}
+	}
+	write_all(batch, batch_len);
+	return count;
+}
+
+static void* writer_main(void* arg) {
+	struct timespec interval = {0, LOG_FLUSH_INTERVAL * 1000000L};
+	while (atomic_load(&running)) {
+		if (drain() == 0) {
+			nanosleep(&interval, NULL);
+		}
+	}
+	drain();
+	return NULL;
+}
 
 void log_init(LogLevel lv, const char* filename) {
 	log_level = lv;
-	log_file = fopen(filename, "w");
-	assert(log_file != NULL);
+	log_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	assert(log_fd >= 0);
+	atomic_store(&running, 1);
+	int err = pthread_create(&writer, NULL, writer_main, NULL);
+	assert(err == 0);
+	// the records before an exit(EXIT_FAILURE) are the ones explaining it
+	if (log_pid == 0) {
+		atexit(log_cleanup);
+	}
+	log_pid = getpid();
 }
 
-void log_(LogLevel lv, const char* fmt, ...) {
-	if (lv < log_level) {
-		return;
-	}
-	time_t now = time(0);
-	char str[4096];	
-	struct tm tm = *gmtime(&now);
-  	strftime(str, sizeof(str), "%Y %x %H:%M:%S", &tm);
-	fprintf(log_file, "%s ", str);
+void log_set_overflow(LogOverflow overflow) {
+	log_overflow = overflow;
+}
+
+static const char* level_name(LogLevel lv) {
 	switch (lv) {
 		case LOG_DEBUG:
-			fprintf(log_file, "DEBUG ");
-			break;
+			return "DEBUG ";
 		case LOG_INFO:
-			fprintf(log_file, "INFO ");
-			break;
-        case LOG_WARN:
-            fprintf(log_file, "WARN ");
-            break;
-		case LOG_ERROR:
-			fprintf(log_file, "ERROR ");
-			break;
-	}
-    va_list arg;
-    va_start(arg, fmt);
-    vfprintf(log_file, fmt, arg);
-    va_end(arg);
-   	fflush(log_file); 
+			return "INFO ";
+		case LOG_WARN:
+			return "WARN ";
+		default:
+			return "ERROR ";
+	}
+}
+
+void log_set_level(LogLevel lv) {
+	log_level = lv;
+}
+
+void log_write(LogLevel lv, const char* fmt, ...) {
+	if (log_fd < 0) {
+		return;
+	}
+	LogRing* ring = ring_get();
+	unsigned int tail = atomic_load_explicit(&(ring->tail), memory_order_relaxed);
+	while (tail - atomic_load_explicit(&(ring->head), memory_order_acquire) == LOG_RING_SLOTS) {
+		if (log_overflow == LOG_DROP) {
+			atomic_fetch_add(&(ring->dropped), 1);
+			return;
+		}
+		sched_yield();
+	}
+	time_t now = time(0);
+	if (now != thread_time_sec) {
+		struct tm tm;
+		gmtime_r(&now, &tm);
+		thread_time_len = strftime(thread_time_str, sizeof(thread_time_str), "%Y %x %H:%M:%S ", &tm);
+		thread_time_sec = now;
+	}
+	LogRecord* record = &(ring->records[tail % LOG_RING_SLOTS]);
+	int size = sizeof(record->data);
+	memcpy(record->data, thread_time_str, thread_time_len);
+	int len = thread_time_len;
+	const char* name = level_name(lv);
+	int name_len = strlen(name);
+	memcpy(record->data + len, name, name_len);
+	len += name_len;
+	va_list arg;
+	va_start(arg, fmt);
+	int ret = vsnprintf(record->data + len, size - len, fmt, arg);
+	va_end(arg);
+	if (ret < 0) {
+		return;
+	}
+	if (ret >= size - len) {
+		// keep the truncated record on a line of its own
+		len = size;
+		record->data[size - 1] = '\n';
+	} else {
+		len += ret;
+	}
+	record->len = len;
+	atomic_store_explicit(&(ring->tail), tail + 1, memory_order_release);
 }
 
 void log_cleanup() {
-	fclose(log_file);
-}
\ No newline at end of file
+	if (log_fd < 0 || getpid() != log_pid) {
+		return;
+	}
+	atomic_store(&running, 0);
+	pthread_join(writer, NULL);
+	close(log_fd);
+	log_fd = -1;
+	LogRing* ring = atomic_exchange(&rings, NULL);
+	while (ring != NULL) {
+		LogRing* next = ring->next;
+		free(ring);
+		ring = next;
+	}
+	thread_ring = NULL;
+}
@@ -1,6 +1,19 @@
 #ifndef __LOG_H__
 #define __LOG_H__
 
+// every thread logging gets a ring of LOG_RING_SLOTS records of at most LOG_RECORD_SIZE bytes
+#define LOG_RING_SLOTS 1024
+#define LOG_RECORD_SIZE 512
+
+// the writer thread looks for new records this often and writes them in batches
+#define LOG_FLUSH_INTERVAL 10
+#define LOG_BATCH_SIZE (1 << 16)
+
+// records below this level are compiled out, set with -DLOG_COMPILE_LEVEL=<n>
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL 0
+#endif
+
 enum LogLevel {
 	LOG_DEBUG = 0,
 	LOG_INFO = 1,
@@ -10,10 +23,35 @@ enum LogLevel {
 
 typedef enum LogLevel LogLevel;
 
+// what log_ does when the ring of the calling thread is full
+enum LogOverflow {
+	LOG_DROP,
+	LOG_BLOCK
+};
+
+typedef enum LogOverflow LogOverflow;
+
+extern LogLevel log_level;
+
+/*
+ * The level is checked before the arguments are evaluated, and calls below
+ * LOG_COMPILE_LEVEL are removed by the compiler altogether.
+ */
+#define log_(lv, ...) \
+	do { \
+		if ((lv) >= LOG_COMPILE_LEVEL && (lv) >= log_level) { \
+			log_write(lv, __VA_ARGS__); \
+		} \
+	} while (0)
+
 void log_init(LogLevel lv, const char* filename);
 
-void log_(LogLevel lv, const char* fmt, ...);
+void log_set_overflow(LogOverflow overflow);
+
+void log_set_level(LogLevel lv);
+
+void log_write(LogLevel lv, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
 
 void log_cleanup();
 
-#endif
\ No newline at end of file
+#endif
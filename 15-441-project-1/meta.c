@@ -0,0 +1,287 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/select.h>
+
+#include "meta.h"
+#include "io.h"
+#include "utils.h"
+#include "log.h"
+
+// anything which may change what a path under a directory resolves to
+#define META_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | \
+                         IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+static MetaEntry* buckets[META_NUM_BUCKETS];
+
+// most recently used first
+static MetaEntry* lru_head;
+static MetaEntry* lru_tail;
+
+static int max_entries;
+static int num_entries;
+static int max_files;
+static int num_files;
+// the kept open files taking descriptors select could watch
+static int low_files;
+static unsigned int generation;
+static int ifd = -1;
+static char* root;
+
+static unsigned int hash(const char* key) {
+    unsigned int h = 5381;
+    while (*key) {
+        h = h * 33 + (unsigned char) *key++;
+    }
+    return h % META_NUM_BUCKETS;
+}
+
+static void lru_remove(MetaEntry* entry) {
+    if (entry->lru_prev != NULL) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_push(MetaEntry* entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = lru_head;
+    if (lru_head != NULL) {
+        lru_head->lru_prev = entry;
+    } else {
+        lru_tail = entry;
+    }
+    lru_head = entry;
+}
+
+static void drop_file(MetaEntry* entry) {
+    if (entry->file != NULL) {
+        if (entry->file->fd < FD_SETSIZE) {
+            low_files--;
+        }
+        meta_release_file(entry->file);
+        entry->file = NULL;
+        num_files--;
+    }
+}
+
+static void meta_unlink(MetaEntry* entry) {
+    MetaEntry** p = &buckets[hash(entry->key)];
+    while (*p != entry) {
+        p = &((*p)->hash_next);
+    }
+    *p = entry->hash_next;
+    lru_remove(entry);
+    num_entries--;
+    drop_file(entry);
+    free(entry->key);
+    free(entry->path);
+    free(entry);
+}
+
+// an event only names a file of one directory, any event drops everything
+static void meta_flush() {
+    while (lru_tail != NULL) {
+        meta_unlink(lru_tail);
+    }
+    generation++;
+}
+
+/*
+ * Watches every directory from the root down to where path stops existing,
+ * so creating a missing one drops the negative entries as well. Adding a
+ * watch twice returns the same one.
+ */
+static int watch(char* path) {
+    char* p = path + strlen(root);
+    while (1) {
+        p = strchr(p + 1, '/');
+        if (p == NULL) {
+            return 1;
+        }
+        if (p[-1] == '/') {
+            continue;
+        }
+        *p = 0;
+        int wd = inotify_add_watch(ifd, path, META_WATCH_MASK);
+        int err = errno;
+        *p = '/';
+        if (wd < 0) {
+            // the rest of the path doesn't exist
+            return err == ENOENT || err == ENOTDIR;
+        }
+    }
+}
+
+int meta_init(const char* www_folder, int max, int max_open) {
+    memset(buckets, 0, sizeof(buckets));
+    lru_head = lru_tail = NULL;
+    max_entries = max;
+    num_entries = 0;
+    max_files = max_open;
+    num_files = 0;
+    low_files = 0;
+    generation = 0;
+    if (max_entries <= 0) {
+        return 1;
+    }
+    if ((ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+        log_(LOG_ERROR, "Error creating the inotify instance of the metadata cache.\n");
+        return 0;
+    }
+    if (inotify_add_watch(ifd, www_folder, META_WATCH_MASK) < 0) {
+        log_(LOG_ERROR, "Error watching %s.\n", www_folder);
+        close(ifd);
+        ifd = -1;
+        return 0;
+    }
+    root = new_str(www_folder);
+    io_need_read(ifd);
+    return 1;
+}
+
+MetaEntry* meta_lookup(const char* key) {
+    if (ifd < 0) {
+        return NULL;
+    }
+    MetaEntry* entry = buckets[hash(key)];
+    while (entry != NULL && strcmp(entry->key, key)) {
+        entry = entry->hash_next;
+    }
+    if (entry != NULL) {
+        lru_remove(entry);
+        lru_push(entry);
+    }
+    return entry;
+}
+
+unsigned int meta_generation() {
+    return generation;
+}
+
+void meta_store(const char* key, DiskJob* job, unsigned int gen) {
+    // an error like EMFILE says nothing about the path
+    if (ifd < 0 || gen != generation || (job->err != 0 && job->err != ENOENT && job->err != ENOTDIR)) {
+        return;
+    }
+    if (!watch(job->path)) {
+        log_(LOG_WARN, "Error watching the directories of %s, it isn't cached\n", job->path);
+        return;
+    }
+    MetaEntry* entry = buckets[hash(key)];
+    while (entry != NULL && strcmp(entry->key, key)) {
+        entry = entry->hash_next;
+    }
+    if (entry != NULL) {
+        meta_unlink(entry);
+    }
+    while (num_entries >= max_entries && lru_tail != NULL) {
+        meta_unlink(lru_tail);
+    }
+    entry = (MetaEntry*) malloc(sizeof(MetaEntry));
+    entry->key = new_str(key);
+    entry->path = new_str(job->path);
+    entry->err = job->err;
+    entry->size = job->st.st_size;
+    entry->ctime = job->st.st_ctime;
+    entry->mime_type = get_mimetype(get_filename_ext(job->path));
+    entry->file = NULL;
+    unsigned int h = hash(key);
+    entry->hash_next = buckets[h];
+    buckets[h] = entry;
+    lru_push(entry);
+    num_entries++;
+}
+
+MetaFile* meta_open_file(MetaEntry* entry) {
+    if (entry->file == NULL) {
+        return NULL;
+    }
+    entry->file->refcount++;
+    return entry->file;
+}
+
+MetaFile* meta_store_file(const char* key, int fd, unsigned int gen) {
+    if (ifd < 0 || max_files <= 0 || gen != generation) {
+        return NULL;
+    }
+    MetaEntry* entry = buckets[hash(key)];
+    while (entry != NULL && strcmp(entry->key, key)) {
+        entry = entry->hash_next;
+    }
+    // a concurrent GET kept its file open already
+    if (entry == NULL || entry->err != 0 || entry->file != NULL) {
+        return NULL;
+    }
+    // the least recently used entries close their files first
+    MetaEntry* victim = lru_tail;
+    while (num_files >= max_files && victim != NULL) {
+        drop_file(victim);
+        victim = victim->lru_prev;
+    }
+    // the low descriptors are left to the sockets when RLIMIT_NOFILE allows it
+    int high = fcntl(fd, F_DUPFD_CLOEXEC, FD_SETSIZE);
+    if (high >= 0) {
+        close(fd);
+        fd = high;
+    } else {
+        low_files++;
+    }
+    MetaFile* file = (MetaFile*) malloc(sizeof(MetaFile));
+    file->fd = fd;
+    file->refcount = 2;
+    entry->file = file;
+    num_files++;
+    return file;
+}
+
+int meta_low_files() {
+    return low_files;
+}
+
+void meta_release_file(MetaFile* file) {
+    file->refcount--;
+    if (file->refcount == 0) {
+        close(file->fd);
+        free(file);
+    }
+}
+
+void meta_poll() {
+    if (ifd < 0) {
+        return;
+    }
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+    while (read(ifd, events, sizeof(events)) > 0) {
+        // the events themselves don't matter, IN_Q_OVERFLOW included
+        changed = 1;
+    }
+    if (changed) {
+        log_(LOG_DEBUG, "The www folder changed, drop %d metadata cache entries\n", num_entries);
+        meta_flush();
+    }
+    io_need_read(ifd);
+}
+
+void meta_cleanup() {
+    while (lru_tail != NULL) {
+        meta_unlink(lru_tail);
+    }
+    if (ifd >= 0) {
+        close(ifd);
+        ifd = -1;
+    }
+    free(root);
+    root = NULL;
+}
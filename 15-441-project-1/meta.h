@@ -0,0 +1,75 @@
+#ifndef __META_H__
+#define __META_H__
+
+#include <time.h>
+
+#include "diskio.h"
+
+#define META_NUM_BUCKETS 1024
+#define META_DEFAULT_MAX_ENTRIES 4096
+#define META_DEFAULT_MAX_FILES 256
+
+// a file kept open for the GETs reading it, closed by its last meta_release_file
+struct MetaFile {
+    int fd;
+    int refcount;
+};
+
+typedef struct MetaFile MetaFile;
+
+/*
+ * What a request path resolves to under the www folder, so a hot path is
+ * served without looking the file up again. Entries are dropped as soon as
+ * inotify reports a change in any of the directories they were found in.
+ */
+struct MetaEntry {
+    char* key;
+    // the file, a directory is resolved to its index.html
+    char* path;
+    // errno of the lookup, the path isn't there if it's not 0
+    int err;
+    long long size;
+    time_t ctime;
+    const char* mime_type;
+    // the file once a GET opened it, holds a reference
+    MetaFile* file;
+    struct MetaEntry* hash_next;
+    struct MetaEntry* lru_prev;
+    struct MetaEntry* lru_next;
+};
+
+typedef struct MetaEntry MetaEntry;
+
+// watches www_folder, 0 entries disables the cache, 0 files never keeps one open
+int meta_init(const char* www_folder, int max_entries, int max_files);
+
+// returns the entry or NULL, it's only valid until the next meta call
+MetaEntry* meta_lookup(const char* key);
+
+// bumped whenever entries are dropped, take it before starting a lookup
+unsigned int meta_generation();
+
+// keeps what an open or stat job found, unless something changed since generation
+void meta_store(const char* key, DiskJob* job, unsigned int generation);
+
+// returns the referenced open file of the entry or NULL
+MetaFile* meta_open_file(MetaEntry* entry);
+
+/*
+ * Keeps fd, the file the entry of key resolves to, open if nothing changed
+ * since generation. Returns the referenced file which took fd over, or NULL
+ * if fd is still the caller's.
+ */
+MetaFile* meta_store_file(const char* key, int fd, unsigned int generation);
+
+void meta_release_file(MetaFile* file);
+
+// how many of the files kept open take a descriptor below FD_SETSIZE
+int meta_low_files();
+
+// takes the inotify events, call it after each io wait
+void meta_poll();
+
+void meta_cleanup();
+
+#endif
@@ -0,0 +1,236 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "metrics.h"
+#include "utils.h"
+#include "log.h"
+#include "overload.h"
+
+#define METRICS_SCRAPE_INIT_SIZE (1 << 13)
+
+// the owner thread is the only writer of a counter, so a relaxed load and store is enough
+#define METRICS_ADD(counter, n) \
+    __atomic_store_n(&(counter), __atomic_load_n(&(counter), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+#define METRICS_GET(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+static const char* route_names[METRICS_NUM_ROUTES] = {"static", "cgi", "plugin", "proxy", "error"};
+
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999, 1};
+
+static char* metrics_path;
+
+// shards are pushed once per thread and live until metrics_cleanup
+static MetricsShard* shards;
+static __thread MetricsShard* local;
+
+static MetricsShard* shard() {
+    if (local == NULL) {
+        local = (MetricsShard*) calloc(1, sizeof(MetricsShard));
+        do {
+            local->next = __atomic_load_n(&shards, __ATOMIC_ACQUIRE);
+        } while (!__atomic_compare_exchange_n(&shards, &(local->next), local, 0, __ATOMIC_RELEASE,
+                                              __ATOMIC_RELAXED));
+    }
+    return local;
+}
+
+static int hist_index(long long value) {
+    if (value < 2 * METRICS_HIST_SUB_BUCKETS) {
+        return value < 0 ? 0 : value;
+    }
+    int exp = 63 - __builtin_clzll(value);
+    if (exp > METRICS_HIST_MAX_EXP) {
+        return METRICS_HIST_BUCKETS - 1;
+    }
+    int sub = (value >> (exp - METRICS_HIST_SUB_BITS)) & (METRICS_HIST_SUB_BUCKETS - 1);
+    return 2 * METRICS_HIST_SUB_BUCKETS + (exp - METRICS_HIST_SUB_BITS - 1) * METRICS_HIST_SUB_BUCKETS + sub;
+}
+
+// the largest value falling into the bucket
+static long long hist_value(int index) {
+    if (index < 2 * METRICS_HIST_SUB_BUCKETS) {
+        return index;
+    }
+    index -= 2 * METRICS_HIST_SUB_BUCKETS;
+    int shift = index / METRICS_HIST_SUB_BUCKETS + 1;
+    long long low = (long long) (METRICS_HIST_SUB_BUCKETS + index % METRICS_HIST_SUB_BUCKETS) << shift;
+    return low + (1LL << shift) - 1;
+}
+
+void metrics_init(const char* path) {
+    metrics_path = path != NULL ? new_str(path) : NULL;
+    shard();
+}
+
+void metrics_accepted(int is_tls) {
+    METRICS_ADD(shard()->accepted[is_tls != 0], 1);
+}
+
+void metrics_dropped() {
+    METRICS_ADD(shard()->dropped, 1);
+}
+
+void metrics_cgi_spawned() {
+    METRICS_ADD(shard()->cgi_spawns, 1);
+}
+
+void metrics_tls_handshake() {
+    METRICS_ADD(shard()->tls_handshakes, 1);
+}
+
+void metrics_request(MetricsRoute route, int status, long long bytes_in, long long bytes_out, long long latency) {
+    MetricsShard* s = shard();
+    if (status >= 400) {
+        route = METRICS_ERROR;
+    }
+    if (status >= 0 && status < METRICS_MAX_STATUS) {
+        METRICS_ADD(s->status[status], 1);
+    }
+    METRICS_ADD(s->bytes_in, bytes_in);
+    METRICS_ADD(s->bytes_out, bytes_out);
+    METRICS_ADD(s->hist[route][hist_index(latency)], 1);
+    METRICS_ADD(s->hist_sum[route], latency);
+}
+
+int metrics_match(Request* request, struct in_addr addr) {
+    return metrics_path != NULL && ntohl(addr.s_addr) >> 24 == 127
+           && !strcmp(request->http_method, "GET")
+           && !strcmp(request->abs_path, metrics_path);
+}
+
+struct Scrape {
+    char* data;
+    int len;
+    int size;
+};
+
+typedef struct Scrape Scrape;
+
+static void append(Scrape* scrape, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+static void append(Scrape* scrape, const char* format, ...) {
+    va_list args;
+    while (1) {
+        va_start(args, format);
+        int n = vsnprintf(scrape->data + scrape->len, scrape->size - scrape->len, format, args);
+        va_end(args);
+        if (n < scrape->size - scrape->len) {
+            scrape->len += n;
+            return;
+        }
+        scrape->size *= 2;
+        scrape->data = (char*) realloc(scrape->data, scrape->size);
+    }
+}
+
+#define SUM_SHARDS(total, field)                                  \
+    do {                                                          \
+        MetricsShard* s_;                                         \
+        total = 0;                                                \
+        for (s_ = shards; s_ != NULL; s_ = s_->next) {            \
+            total += METRICS_GET(s_->field);                      \
+        }                                                         \
+    } while (0)
+
+static void scrape_counters(Scrape* scrape, int num_conns, int max_conns) {
+    long long total;
+    append(scrape, "# TYPE lisod_connections_accepted_total counter\n");
+    SUM_SHARDS(total, accepted[0]);
+    append(scrape, "lisod_connections_accepted_total{scheme=\"http\"} %lld\n", total);
+    SUM_SHARDS(total, accepted[1]);
+    append(scrape, "lisod_connections_accepted_total{scheme=\"https\"} %lld\n", total);
+    append(scrape, "# TYPE lisod_connections_dropped_total counter\n");
+    SUM_SHARDS(total, dropped);
+    append(scrape, "lisod_connections_dropped_total %lld\n", total);
+    append(scrape, "# TYPE lisod_connections gauge\n");
+    append(scrape, "lisod_connections %d\n", num_conns);
+    append(scrape, "# TYPE lisod_connections_max gauge\n");
+    append(scrape, "lisod_connections_max %d\n", max_conns);
+    append(scrape, "# TYPE lisod_loop_lag_seconds gauge\n");
+    append(scrape, "lisod_loop_lag_seconds %.6f\n", overload_lag() / 1e6);
+    append(scrape, "# TYPE lisod_shedding gauge\n");
+    append(scrape, "lisod_shedding %d\n", overload_active());
+    append(scrape, "# TYPE lisod_requests_total counter\n");
+    int status;
+    for (status = 0; status != METRICS_MAX_STATUS; ++status) {
+        SUM_SHARDS(total, status[status]);
+        if (total > 0) {
+            append(scrape, "lisod_requests_total{status=\"%d\"} %lld\n", status, total);
+        }
+    }
+    append(scrape, "# TYPE lisod_received_bytes_total counter\n");
+    SUM_SHARDS(total, bytes_in);
+    append(scrape, "lisod_received_bytes_total %lld\n", total);
+    append(scrape, "# TYPE lisod_sent_bytes_total counter\n");
+    SUM_SHARDS(total, bytes_out);
+    append(scrape, "lisod_sent_bytes_total %lld\n", total);
+    append(scrape, "# TYPE lisod_cgi_spawns_total counter\n");
+    SUM_SHARDS(total, cgi_spawns);
+    append(scrape, "lisod_cgi_spawns_total %lld\n", total);
+    append(scrape, "# TYPE lisod_tls_handshakes_total counter\n");
+    SUM_SHARDS(total, tls_handshakes);
+    append(scrape, "lisod_tls_handshakes_total %lld\n", total);
+}
+
+static void scrape_histograms(Scrape* scrape) {
+    static long long hist[METRICS_HIST_BUCKETS];
+    append(scrape, "# TYPE lisod_request_duration_seconds summary\n");
+    int route, i, q;
+    for (route = 0; route != METRICS_NUM_ROUTES; ++route) {
+        long long count = 0, sum;
+        for (i = 0; i != METRICS_HIST_BUCKETS; ++i) {
+            SUM_SHARDS(hist[i], hist[route][i]);
+            count += hist[i];
+        }
+        SUM_SHARDS(sum, hist_sum[route]);
+        long long seen = 0;
+        for (i = 0, q = 0; q != sizeof(quantiles) / sizeof(quantiles[0]); ++q) {
+            long long rank = (long long) (quantiles[q] * count + 0.5);
+            while (i != METRICS_HIST_BUCKETS - 1 && (seen + hist[i] < rank || hist[i] == 0)) {
+                seen += hist[i++];
+            }
+            append(scrape, "lisod_request_duration_seconds{route=\"%s\",quantile=\"%g\"} %.6f\n",
+                   route_names[route], quantiles[q], count > 0 ? hist_value(i) / 1e6 : 0.0);
+        }
+        append(scrape, "lisod_request_duration_seconds_sum{route=\"%s\"} %.6f\n", route_names[route], sum / 1e6);
+        append(scrape, "lisod_request_duration_seconds_count{route=\"%s\"} %lld\n", route_names[route], count);
+    }
+}
+
+CacheEntry* metrics_scrape(int num_conns, int max_conns) {
+    Scrape body;
+    body.size = METRICS_SCRAPE_INIT_SIZE;
+    body.len = 0;
+    body.data = (char*) malloc(body.size);
+    scrape_counters(&body, num_conns, max_conns);
+    scrape_histograms(&body);
+    Scrape res;
+    res.size = body.len + 128;
+    res.len = 0;
+    res.data = (char*) malloc(res.size);
+    append(&res, "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\n\r\n",
+           body.len);
+    if (res.len + body.len > res.size) {
+        res.size = res.len + body.len;
+        res.data = (char*) realloc(res.data, res.size);
+    }
+    memcpy(res.data + res.len, body.data, body.len);
+    res.len += body.len;
+    free(body.data);
+    log_(LOG_DEBUG, "Scrape the metrics, %d byte(s)\n", res.len);
+    return cache_wrap(res.data, res.len);
+}
+
+void metrics_cleanup() {
+    while (shards != NULL) {
+        MetricsShard* next = shards->next;
+        free(shards);
+        shards = next;
+    }
+    local = NULL;
+    free(metrics_path);
+    metrics_path = NULL;
+}
@@ -0,0 +1,75 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <netinet/in.h>
+
+#include "http.h"
+#include "cache.h"
+
+/*
+ * Latencies are kept in microseconds in log-linear buckets, the way HDR
+ * histograms do: values below 2 * METRICS_HIST_SUB_BUCKETS get a bucket each,
+ * every larger power of two is split into 2^METRICS_HIST_SUB_BITS buckets,
+ * so a bucket is never wider than 1/8 of its values.
+ */
+#define METRICS_HIST_SUB_BITS 3
+#define METRICS_HIST_SUB_BUCKETS (1 << METRICS_HIST_SUB_BITS)
+#define METRICS_HIST_MAX_EXP 39
+#define METRICS_HIST_BUCKETS \
+    (2 * METRICS_HIST_SUB_BUCKETS + (METRICS_HIST_MAX_EXP - METRICS_HIST_SUB_BITS) * METRICS_HIST_SUB_BUCKETS)
+
+#define METRICS_MAX_STATUS 600
+
+enum MetricsRoute {
+    METRICS_STATIC,
+    METRICS_CGI,
+    METRICS_PLUGIN,
+    METRICS_PROXY,
+    // any route answering with a 4xx or 5xx status
+    METRICS_ERROR,
+    METRICS_NUM_ROUTES
+};
+
+typedef enum MetricsRoute MetricsRoute;
+
+/*
+ * Every thread counts into a shard of its own with plain relaxed stores, the
+ * shards are only summed up when the endpoint is scraped.
+ */
+struct MetricsShard {
+    long long accepted[2];
+    long long dropped;
+    long long status[METRICS_MAX_STATUS];
+    long long bytes_in;
+    long long bytes_out;
+    long long cgi_spawns;
+    long long tls_handshakes;
+    long long hist[METRICS_NUM_ROUTES][METRICS_HIST_BUCKETS];
+    long long hist_sum[METRICS_NUM_ROUTES];
+    struct MetricsShard* next;
+};
+
+typedef struct MetricsShard MetricsShard;
+
+// path NULL disables the endpoint, it's only served to loopback clients
+void metrics_init(const char* path);
+
+void metrics_accepted(int is_tls);
+
+void metrics_dropped();
+
+void metrics_cgi_spawned();
+
+void metrics_tls_handshake();
+
+// latency is in microseconds from the end of the request head to the last response byte
+void metrics_request(MetricsRoute route, int status, long long bytes_in, long long bytes_out, long long latency);
+
+int metrics_match(Request* request, struct in_addr addr);
+
+// the scrape as a complete response, release it with cache_release
+CacheEntry* metrics_scrape(int num_conns, int max_conns);
+
+void metrics_cleanup();
+
+#endif
@@ -0,0 +1,78 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "overload.h"
+#include "io.h"
+#include "utils.h"
+#include "log.h"
+
+static const char response[] = "HTTP/1.1 503 Service Unavailable\r\n"
+                               "Content-Length: 0\r\n"
+                               "Retry-After: 1\r\n"
+                               "Connection: close\r\n"
+                               "\r\n";
+
+static long long threshold;
+static long long lag;
+static long long woke_at;
+static int active;
+static CacheEntry* shed_entry;
+
+void overload_init(int lag_threshold_ms) {
+    threshold = lag_threshold_ms * 1000LL;
+    lag = 0;
+    woke_at = 0;
+    active = 0;
+    if (threshold > 0) {
+        int len = sizeof(response) - 1;
+        char* data = (char*) malloc(len);
+        memcpy(data, response, len);
+        shed_entry = cache_wrap(data, len);
+    }
+}
+
+void overload_begin_iteration() {
+    woke_at = get_monotonic_time_us();
+}
+
+void overload_end_iteration() {
+    if (woke_at == 0) {
+        return;
+    }
+    long long busy = get_monotonic_time_us() - woke_at;
+    lag += (busy - lag) / 8;
+    if (threshold <= 0) {
+        return;
+    }
+    if (!active && lag > threshold) {
+        active = 1;
+        log_(LOG_WARN, "The event loop lags %lld us behind, start shedding load\n", lag);
+    } else if (active && lag < threshold / 2) {
+        active = 0;
+        log_(LOG_WARN, "The event loop lag is down to %lld us, stop shedding load\n", lag);
+    }
+    if (active) {
+        // nothing new is accepted, keep measuring while the table drains
+        io_need_timeout(OVERLOAD_CHECK_INTERVAL);
+    }
+}
+
+int overload_active() {
+    return active;
+}
+
+long long overload_lag() {
+    return lag;
+}
+
+CacheEntry* overload_response() {
+    shed_entry->refcount++;
+    return shed_entry;
+}
+
+void overload_cleanup() {
+    if (shed_entry != NULL) {
+        cache_release(shed_entry);
+        shed_entry = NULL;
+    }
+}
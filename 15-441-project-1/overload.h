@@ -0,0 +1,34 @@
+#ifndef __OVERLOAD_H__
+#define __OVERLOAD_H__
+
+#include "cache.h"
+
+// how long a keep-alive connection may stay idle while overloaded, in milliseconds
+#define OVERLOAD_IDLE_TIMEOUT 1000
+// how often the loop wakes up to measure itself while it doesn't accept
+#define OVERLOAD_CHECK_INTERVAL 100
+
+/*
+ * The lag is the time the loop spends between two io waits, smoothed over
+ * the last iterations: what a ready client waits for at worst before its
+ * connection is looked at. It's always measured, above a non-zero threshold
+ * lisod sheds load until the lag drops back under half of it.
+ */
+void overload_init(int lag_threshold_ms);
+
+// called as the loop wakes up from its io wait and before it waits again
+void overload_begin_iteration();
+
+void overload_end_iteration();
+
+int overload_active();
+
+// the smoothed lag in microseconds
+long long overload_lag();
+
+// a referenced 503 response closing the connection, release it with cache_release
+CacheEntry* overload_response();
+
+void overload_cleanup();
+
+#endif
@@ -0,0 +1,146 @@
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <arpa/inet.h>
+
+#include "plugin.h"
+#include "utils.h"
+#include "log.h"
+
+static PluginEntry* entries = NULL;
+
+static const char* plugin_get_header(const LisoPluginRequest* plugin_request, const char* name) {
+    return request_get_header((Request*) plugin_request->host, name);
+}
+
+int plugin_load(const char* spec) {
+    const char* sep = strchr(spec, '=');
+    if (sep == NULL || sep == spec || sep - spec >= PLUGIN_MAX_PREFIX_SIZE || spec[0] != '/') {
+        log_(LOG_ERROR, "Invalid plugin specification %s\n", spec);
+        return 0;
+    }
+    const char* path = sep + 1;
+    void* dl = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (dl == NULL) {
+        log_(LOG_ERROR, "Error loading plugin %s: %s\n", path, dlerror());
+        return 0;
+    }
+    const LisoPlugin* impl = (const LisoPlugin*) dlsym(dl, LISO_PLUGIN_SYMBOL);
+    if (impl == NULL || impl->abi_version != LISO_PLUGIN_ABI_VERSION
+        || impl->create == NULL || impl->write == NULL || impl->read == NULL || impl->destroy == NULL) {
+        log_(LOG_ERROR, "Plugin %s doesn't export a compatible %s\n", path, LISO_PLUGIN_SYMBOL);
+        dlclose(dl);
+        return 0;
+    }
+    PluginEntry* entry = (PluginEntry*) malloc(sizeof(PluginEntry));
+    memcpy(entry->prefix, spec, sep - spec);
+    entry->prefix[sep - spec] = 0;
+    entry->dl = dl;
+    entry->impl = impl;
+    if (impl->init != NULL && !impl->init(entry->prefix)) {
+        log_(LOG_ERROR, "Plugin %s refuses to be registered on %s\n", path, entry->prefix);
+        free(entry);
+        dlclose(dl);
+        return 0;
+    }
+    entry->next = entries;
+    entries = entry;
+    log_(LOG_INFO, "Register plugin %s on %s\n", impl->name != NULL ? impl->name : path, entry->prefix);
+    return 1;
+}
+
+const PluginEntry* plugin_match(Request* request) {
+    // the longest matching prefix wins
+    const PluginEntry* match = NULL;
+    int match_len = 0;
+    PluginEntry* entry;
+    for (entry = entries; entry != NULL; entry = entry->next) {
+        int len = match_prefix(request->abs_path, entry->prefix);
+        if (len > match_len) {
+            match = entry;
+            match_len = len;
+        }
+    }
+    return match;
+}
+
+void plugin_init(Plugin* plugin, const PluginEntry* entry, Request* request, struct in_addr addr, int is_tls) {
+    plugin->entry = entry;
+    plugin->request = request;
+    plugin->req_content_length = 0;
+    plugin->last_req = request_connection_close(request);
+    inet_ntop(AF_INET, &addr, plugin->remote_addr, sizeof(plugin->remote_addr));
+    LisoPluginRequest* plugin_request = &(plugin->plugin_request);
+    plugin_request->http_method = request->http_method;
+    plugin_request->http_version = request->http_version;
+    plugin_request->abs_path = request->abs_path;
+    plugin_request->query = request->query;
+    plugin_request->remote_addr = plugin->remote_addr;
+    plugin_request->content_length = request->content_length;
+    plugin_request->is_tls = is_tls;
+    plugin_request->get_header = plugin_get_header;
+    plugin_request->host = request;
+    plugin->ctx = request->content_length < 0 ? NULL : entry->impl->create(plugin_request);
+    if (plugin->ctx == NULL) {
+        plugin->state = PLUGIN_FAILED;
+    } else {
+        plugin->state = request->content_length == 0 ? PLUGIN_SEND : PLUGIN_RECV;
+    }
+}
+
+void plugin_read(Plugin* plugin, Buffer* buf) {
+    if (plugin->state != PLUGIN_SEND) {
+        log_(LOG_WARN, "plugin_read is called when plugin state isn't PLUGIN_SEND\n");
+        return;
+    }
+    while (!buffer_is_full(buf)) {
+        int ret = plugin->entry->impl->read(plugin->ctx, buffer_input_ptr(buf), buffer_input_size(buf));
+        if (ret < 0) {
+            plugin->state = PLUGIN_FAILED;
+            return;
+        } else if (ret == 0) {
+            plugin->state = PLUGIN_FINISHED;
+            return;
+        }
+        buffer_input(buf, min(ret, buffer_input_size(buf)));
+    }
+}
+
+void plugin_write(Plugin* plugin, Buffer* buf) {
+    if (plugin->state != PLUGIN_RECV) {
+        log_(LOG_WARN, "plugin_write is called when plugin state isn't PLUGIN_RECV\n");
+        return;
+    }
+    int len = min(buffer_output_size(buf), plugin->request->content_length - plugin->req_content_length);
+    int ret = plugin->entry->impl->write(plugin->ctx, buffer_output_ptr(buf), len);
+    if (ret <= 0) {
+        plugin->state = PLUGIN_FAILED;
+        return;
+    }
+    ret = min(ret, len);
+    buffer_output(buf, ret);
+    plugin->req_content_length += ret;
+    if (plugin->req_content_length == plugin->request->content_length) {
+        plugin->state = PLUGIN_SEND;
+    }
+}
+
+void plugin_destroy(Plugin* plugin) {
+    if (plugin->ctx != NULL) {
+        plugin->entry->impl->destroy(plugin->ctx);
+    }
+    request_destroy(plugin->request);
+    free(plugin->request);
+}
+
+void plugin_cleanup() {
+    while (entries != NULL) {
+        PluginEntry* entry = entries;
+        entries = entry->next;
+        if (entry->impl->cleanup != NULL) {
+            entry->impl->cleanup();
+        }
+        dlclose(entry->dl);
+        free(entry);
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef __PLUGIN_H__
+#define __PLUGIN_H__
+
+#include <netinet/in.h>
+
+#include "liso_plugin.h"
+#include "http.h"
+#include "buffer.h"
+
+#define PLUGIN_MAX_PREFIX_SIZE 256
+
+enum PluginState {
+    PLUGIN_RECV,
+    PLUGIN_SEND,
+    PLUGIN_FAILED,
+    PLUGIN_FINISHED
+};
+
+typedef enum PluginState PluginState;
+
+// a shared object registered on a path prefix
+struct PluginEntry {
+    char prefix[PLUGIN_MAX_PREFIX_SIZE];
+    void* dl;
+    const LisoPlugin* impl;
+    struct PluginEntry* next;
+};
+
+typedef struct PluginEntry PluginEntry;
+
+struct Plugin {
+    const PluginEntry* entry;
+    void* ctx;
+    Request* request;
+    LisoPluginRequest plugin_request;
+    char remote_addr[INET_ADDRSTRLEN];
+    int req_content_length;
+    int last_req;
+    PluginState state;
+};
+
+typedef struct Plugin Plugin;
+
+// spec is "<path prefix>=<shared object path>"
+int plugin_load(const char* spec);
+
+const PluginEntry* plugin_match(Request* request);
+
+void plugin_init(Plugin* plugin, const PluginEntry* entry, Request* request, struct in_addr addr, int is_tls);
+
+void plugin_read(Plugin* plugin, Buffer* buf);
+
+void plugin_write(Plugin* plugin, Buffer* buf);
+
+void plugin_destroy(Plugin* plugin);
+
+void plugin_cleanup();
+
+#endif
@@ -0,0 +1,78 @@
+/*
+ * An example native handler, it answers with the request line and the size
+ * of the request body.
+ *
+ * make plugins && ./lisod ... --plugin /hello=./plugins/hello.so
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "liso_plugin.h"
+
+struct Hello {
+    char res[1024];
+    int res_len;
+    int res_sent;
+    int body_len;
+    const LisoPluginRequest* request;
+};
+
+typedef struct Hello Hello;
+
+static void* hello_create(const LisoPluginRequest* request) {
+    Hello* hello = (Hello*) calloc(1, sizeof(Hello));
+    if (hello != NULL) {
+        hello->res_len = -1;
+        hello->request = request;
+    }
+    return hello;
+}
+
+static int hello_write(void* ctx, const char* data, int size) {
+    ((Hello*) ctx)->body_len += size;
+    return size;
+}
+
+static int hello_read(void* ctx, char* buf, int size) {
+    Hello* hello = (Hello*) ctx;
+    if (hello->res_len < 0) {
+        const LisoPluginRequest* request = hello->request;
+        char body[512];
+        int body_len = snprintf(body, sizeof(body), "hello %s: %s %s%s%s, %d byte(s) of body\n",
+                                request->remote_addr, request->http_method, request->abs_path,
+                                request->query[0] ? "?" : "", request->query, hello->body_len);
+        // snprintf returns the length it would have written, a long path is cut off
+        if (body_len >= (int) sizeof(body)) {
+            body_len = sizeof(body) - 1;
+        }
+        hello->res_len = snprintf(hello->res, sizeof(hello->res),
+                                  "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: %d\r\n\r\n%s",
+                                  body_len, body);
+        if (hello->res_len >= (int) sizeof(hello->res)) {
+            hello->res_len = sizeof(hello->res) - 1;
+        }
+    }
+    int len = hello->res_len - hello->res_sent;
+    if (len > size) {
+        len = size;
+    }
+    memcpy(buf, hello->res + hello->res_sent, len);
+    hello->res_sent += len;
+    return len;
+}
+
+static void hello_destroy(void* ctx) {
+    free(ctx);
+}
+
+const LisoPlugin liso_plugin = {
+        LISO_PLUGIN_ABI_VERSION,
+        "hello",
+        NULL,
+        hello_create,
+        hello_write,
+        hello_read,
+        hello_destroy,
+        NULL
+};
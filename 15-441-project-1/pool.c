@@ -3,11 +3,17 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/select.h>
 
 #include "io.h"
 #include "utils.h"
 #include "pool.h"
 #include "log.h"
+#include "metrics.h"
+#include "admin.h"
+#include "probes.h"
+#include "overload.h"
+#include "meta.h"
 
 static void pool_http_start(Pool *pool, int http_port) {
     struct sockaddr_in addr;
@@ -111,6 +117,7 @@ void pool_init(Pool *pool, int max_conns) {
     pool->max_conns = max_conns;
     pool->num_conns = 0;
     pool->conns = NULL;
+    pool->run_queue = (Conn **) malloc(sizeof(Conn *) * max_conns);
     pool->ssl_context = NULL;
 }
 
@@ -126,10 +133,12 @@ void pool_destroy(Pool *pool) {
     close(pool->http_sock);
     close(pool->https_sock);
     SSL_CTX_free(pool->ssl_context);
+    free(pool->run_queue);
 }
 
 int pool_is_full(Pool *pool) {
-    return pool->num_conns == pool->max_conns;
+    // files kept open by the metadata cache may take descriptors select needs
+    return pool->num_conns + meta_low_files() >= pool->max_conns;
 }
 
 void pool_add_conn(Pool *pool, Conn *new_conn) {
@@ -155,12 +164,49 @@ void pool_remove_conn(Pool *pool, Conn *conn) {
     if (pool->conns == conn) {
         pool->conns = conn->next;
     }
+    admin_forget(conn);
     conn_destroy(conn);
     free(conn);
 }
 
+static int shorter_first(const void *a, const void *b) {
+    Conn *x = *(Conn **) a, *y = *(Conn **) b;
+    long long rx = conn_remaining(x), ry = conn_remaining(y);
+    if (rx != ry) {
+        return rx < ry ? -1 : 1;
+    }
+    return x->requeued - y->requeued;
+}
+
+int pool_schedule(Pool *pool, int shortest_first) {
+    int n = 0;
+    Conn *conn;
+    for (conn = pool->conns; conn != NULL; conn = conn->next) {
+        if (!conn->requeued) {
+            pool->run_queue[n++] = conn;
+        }
+    }
+    for (conn = pool->conns; conn != NULL; conn = conn->next) {
+        if (conn->requeued) {
+            pool->run_queue[n++] = conn;
+        }
+    }
+    if (shortest_first) {
+        qsort(pool->run_queue, n, sizeof(Conn *), shorter_first);
+    }
+    for (conn = pool->conns; conn != NULL; conn = conn->next) {
+        conn->requeued = 0;
+    }
+    return n;
+}
+
 void pool_wait_io(Pool *pool) {
     log_(LOG_DEBUG, "The connection pool is waiting for io\n");
+    if (overload_active()) {
+        // new connections wait in the listen backlog until the loop catches up
+        io_wait();
+        return;
+    }
     io_need_read(pool->http_sock);
     io_need_read(pool->https_sock);
     io_wait();
@@ -179,12 +225,15 @@ void pool_wait_io(Pool *pool) {
                     perror("accept");
             }
             break;
-        } else if (!pool_is_full(pool)) {
+        } else if (!pool_is_full(pool) && sockfd < FD_SETSIZE) {
             Conn *conn = (Conn *) malloc(sizeof(Conn));
             conn_init(conn, sockfd, NULL, cli_addr.sin_addr);
             pool_add_conn(pool, conn);
+            metrics_accepted(0);
+            PROBE2(accept, sockfd, 0);
         } else {
             close(sockfd);
+            metrics_dropped();
             log_(LOG_INFO,
                  "Drop the new http connection due to the connection pool is full, number of connections = %d\n",
                  pool->num_conns);
@@ -202,7 +251,7 @@ void pool_wait_io(Pool *pool) {
                     perror("accept");
             }
             break;
-        } else if (!pool_is_full(pool)) {
+        } else if (!pool_is_full(pool) && sockfd < FD_SETSIZE) {
             SSL *ssl = SSL_new(pool->ssl_context);
             if (ssl != NULL) {
                 int success = 1;
@@ -216,6 +265,8 @@ void pool_wait_io(Pool *pool) {
                     Conn *conn = (Conn *) malloc(sizeof(Conn));
                     conn_init(conn, sockfd, ssl, cli_addr.sin_addr);
                     pool_add_conn(pool, conn);
+                    metrics_accepted(1);
+                    PROBE2(accept, sockfd, 1);
                 } else {
                     SSL_free(ssl);
                     close(sockfd);
@@ -226,6 +277,7 @@ void pool_wait_io(Pool *pool) {
             }
         } else {
             close(sockfd);
+            metrics_dropped();
             log_(LOG_INFO,
                  "Drop the new https connection due to the connection pool is full, number of connections = %d\n",
                  pool->num_conns);
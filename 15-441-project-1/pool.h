@@ -11,6 +11,8 @@ struct Pool {
     int http_sock;
     int https_sock;
 	Conn* conns; 
+	// the connections in the order they get their turn, filled by pool_schedule
+	Conn** run_queue;
 	SSL_CTX* ssl_context;	
 };
 
@@ -32,4 +34,8 @@ void pool_wait_io(Pool* pool);
 
 Conn* pool_next_conn(Pool* pool);
 
+// fills the run queue and returns its length, connections which ran out of
+// budget go last, or every connection is ordered by its remaining response
+int pool_schedule(Pool* pool, int shortest_first);
+
 #endif
\ No newline at end of file
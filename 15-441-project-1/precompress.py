@@ -0,0 +1,108 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+"""
+    Precompress
+    ~~~~~~~~~~~
+
+    Writes the .br, .zst and .gz siblings lisod --precompressed serves in
+    place of the static files of a www folder. Only text files are
+    compressed, a sibling is skipped when it wouldn't save a tenth of the
+    file, and rewritten only when it's older than the file. brotli and zstd
+    are used through their python modules or their command line tools,
+    whichever is installed, gzip always works.
+
+    usage: ./precompress.py <www folder>
+"""
+
+import gzip
+import os
+import shutil
+import subprocess
+import sys
+
+EXTENSIONS = {'.html', '.htm', '.css', '.js', '.mjs', '.json', '.svg', '.txt', '.xml', '.csv', '.map'}
+SUFFIXES = ('.br', '.zst', '.gz')
+MIN_SIZE = 256
+MIN_SAVING = 0.1
+
+
+def compress_command(args, data):
+    return subprocess.run(args, input=data, stdout=subprocess.PIPE, check=True).stdout
+
+
+def brotli_compressor():
+    try:
+        import brotli
+        return lambda data: brotli.compress(data, quality=11)
+    except ImportError:
+        pass
+    if shutil.which('brotli'):
+        return lambda data: compress_command(['brotli', '-c', '-q', '11'], data)
+    return None
+
+
+def zstd_compressor():
+    try:
+        import zstandard
+        return lambda data: zstandard.ZstdCompressor(level=19).compress(data)
+    except ImportError:
+        pass
+    if shutil.which('zstd'):
+        return lambda data: compress_command(['zstd', '-c', '-q', '-19'], data)
+    return None
+
+
+def compressors():
+    result = [('.gz', lambda data: gzip.compress(data, compresslevel=9, mtime=0))]
+    for suffix, compressor in (('.br', brotli_compressor()), ('.zst', zstd_compressor())):
+        if compressor is None:
+            print('no %s compressor installed, skipping %s siblings' % (suffix[1:], suffix), file=sys.stderr)
+        else:
+            result.append((suffix, compressor))
+    return result
+
+
+def precompress(path, compressors):
+    mtime = os.stat(path).st_mtime
+    data = None
+    written = 0
+    for suffix, compressor in compressors:
+        sibling = path + suffix
+        if os.path.exists(sibling) and os.stat(sibling).st_mtime >= mtime:
+            continue
+        if data is None:
+            with open(path, 'rb') as f:
+                data = f.read()
+        compressed = compressor(data)
+        if len(compressed) > len(data) * (1 - MIN_SAVING):
+            if os.path.exists(sibling):
+                os.unlink(sibling)
+            continue
+        # renamed into place so lisod never serves a partly written sibling
+        tmp = os.path.join(os.path.dirname(path), '.' + os.path.basename(sibling) + '.tmp')
+        with open(tmp, 'wb') as f:
+            f.write(compressed)
+        os.rename(tmp, sibling)
+        written += 1
+    return written
+
+
+def main():
+    if len(sys.argv) != 2:
+        print('usage: ./precompress.py <www folder>', file=sys.stderr)
+        sys.exit(1)
+    available = compressors()
+    files = written = 0
+    for root, dirs, names in os.walk(sys.argv[1]):
+        for name in names:
+            path = os.path.join(root, name)
+            if (name.endswith(SUFFIXES) or os.path.splitext(name)[1].lower() not in EXTENSIONS
+                    or not os.path.isfile(path) or os.path.getsize(path) < MIN_SIZE):
+                continue
+            files += 1
+            written += precompress(path, available)
+    print('%d file(s) checked, %d sibling(s) written' % (files, written))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,41 @@
+#ifndef __PROBES_H__
+#define __PROBES_H__
+
+/*
+ * USDT probes of the lisod provider, e.g.
+ *
+ *     bpftrace -e 'usdt:./lisod:lisod:conn_state { printf("%d %d->%d\n", arg0, arg1, arg2); }'
+ *
+ * They're only compiled in with -DLISOD_USDT (make usdt), which needs
+ * sys/sdt.h from systemtap. Otherwise they expand to nothing and their
+ * arguments aren't even evaluated.
+ *
+ *     accept(fd, is_tls)
+ *     conn_state(fd, from, to)                       ConnState values
+ *     request(fd, method, path)                      a request head is parsed
+ *     handle_start(fd, path)                         the static file handler takes over
+ *     cgi_start(fd, path)                            the cgi handler takes over
+ *     request_done(fd, route, status, latency_us)    MetricsRoute value
+ *     send(fd, bytes) / recv(fd, bytes)
+ *     cgi_spawn(pid) / cgi_exit(pid)
+ */
+
+#ifdef LISOD_USDT
+
+#include <sys/sdt.h>
+
+#define PROBE1(name, a) DTRACE_PROBE1(lisod, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(lisod, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(lisod, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(lisod, name, a, b, c, d)
+
+#else
+
+#define PROBE1(name, a) do {} while (0)
+#define PROBE2(name, a, b) do {} while (0)
+#define PROBE3(name, a, b, c) do {} while (0)
+#define PROBE4(name, a, b, c, d) do {} while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,634 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "proxy.h"
+#include "io.h"
+#include "utils.h"
+#include "log.h"
+
+static int timeout = PROXY_DEFAULT_TIMEOUT;
+
+void proxy_set_timeout(int ms) {
+    timeout = ms;
+}
+
+// hop-by-hop headers only concern a single connection and are never forwarded
+static int is_hop_by_hop(const char* name, int name_len) {
+    static const char* names[] = {"Connection", "Keep-Alive", "Proxy-Connection", "TE", "Upgrade", NULL};
+    int i;
+    for (i = 0; names[i] != NULL; ++i) {
+        if (name_len == strlen(names[i]) && !strncasecmp(name, names[i], name_len)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// headers are kept in reverse order, write them out in the order they were received
+static char* write_headers(char* p, RequestHeader* header) {
+    if (header == NULL) {
+        return p;
+    }
+    p = write_headers(p, header->next);
+    if (is_hop_by_hop(header->header_name, strlen(header->header_name))
+        || !strcasecmp(header->header_name, "X-Forwarded-For")) {
+        return p;
+    }
+    return p + sprintf(p, "%s: %s\r\n", header->header_name, header->header_value);
+}
+
+static void build_request_head(Proxy* proxy, const char* remote_addr, int is_tls) {
+    Request* request = proxy->request;
+    int len = strlen(request->http_method) + strlen(request->abs_path) + strlen(request->query) + 256;
+    RequestHeader* header;
+    for (header = request->headers; header != NULL; header = header->next) {
+        len += strlen(header->header_name) + strlen(header->header_value) + 4;
+    }
+    char* forwarded_for = request_get_header(request, "X-Forwarded-For");
+    proxy->req_head = (char*) malloc(len);
+    char* p = proxy->req_head;
+    p += sprintf(p, "%s %s%s%s HTTP/1.1\r\n", request->http_method, request->abs_path,
+                 request->query[0] ? "?" : "", request->query);
+    p = write_headers(p, request->headers);
+    p += sprintf(p, "X-Forwarded-For: %s%s%s\r\nX-Forwarded-Proto: %s\r\nConnection: keep-alive\r\n\r\n",
+                 forwarded_for != NULL ? forwarded_for : "", forwarded_for != NULL ? ", " : "", remote_addr,
+                 is_tls ? "https" : "http");
+    proxy->req_head_len = p - proxy->req_head;
+    proxy->req_head_sent = 0;
+}
+
+static void proxy_detach(Proxy* proxy) {
+    if (proxy->attached) {
+        proxy->upstream->outstanding--;
+        proxy->attached = 0;
+    }
+}
+
+static void proxy_close(Proxy* proxy) {
+    if (proxy->fd >= 0) {
+        close(proxy->fd);
+        proxy->fd = -1;
+    }
+}
+
+static void proxy_fail(Proxy* proxy, StatusCode error) {
+    proxy_detach(proxy);
+    proxy_close(proxy);
+    proxy->state = PROXY_ERROR;
+    proxy->error = error;
+    proxy->last_req = 1;
+}
+
+static void upstream_error(Proxy* proxy);
+
+static void touch(Proxy* proxy);
+
+static void proxy_connect(Proxy* proxy, Upstream* upstream) {
+    proxy_detach(proxy);
+    proxy->upstream = upstream;
+    proxy->upstream->outstanding++;
+    proxy->attached = 1;
+    proxy->attempts++;
+    proxy->fd = upstream_acquire(proxy->upstream, &(proxy->reused));
+    if (proxy->fd < 0) {
+        upstream_error(proxy);
+        return;
+    }
+    proxy->state = proxy->reused ? PROXY_SEND : PROXY_CONNECT;
+    touch(proxy);
+    proxy->req_head_sent = 0;
+    proxy->head_len = 0;
+}
+
+/*
+ * A reused connection may have been closed by the upstream while idle, and
+ * other servers of the group may work when one doesn't. The request is sent
+ * again as long as nothing has been received and no part of the body, which
+ * isn't kept, has been consumed.
+ */
+static void upstream_error(Proxy* proxy) {
+    int can_retry = proxy->head_len == 0 && proxy->req_content_length == 0;
+    proxy_close(proxy);
+    if (can_retry && proxy->reused) {
+        log_(LOG_DEBUG, "The idle connection to upstream %s is gone, retry\n", proxy->upstream->name);
+        proxy_connect(proxy, proxy->upstream);
+        return;
+    }
+    log_(LOG_WARN, "Error talking to upstream %s\n", proxy->upstream->name);
+    upstream_report(proxy->upstream, 0);
+    if (can_retry && proxy->attempts < proxy->group->num_servers) {
+        proxy_connect(proxy, upstream_pick(proxy->group, proxy->request));
+        return;
+    }
+    if (proxy->head_done) {
+        // part of the response has been sent, the client can only be disconnected
+        proxy_detach(proxy);
+        proxy->state = PROXY_FAILED;
+    } else {
+        proxy_fail(proxy, BAD_GATEWAY);
+    }
+}
+
+static void touch(Proxy* proxy) {
+    proxy->deadline = timeout > 0 ? get_monotonic_time_ms() + timeout : -1;
+}
+
+// returns 1 if the upstream has run out of time, otherwise make sure the event loop wakes up for it
+static int is_timed_out(Proxy* proxy) {
+    if (proxy->deadline < 0) {
+        return 0;
+    }
+    long long remaining = proxy->deadline - get_monotonic_time_ms();
+    if (remaining > 0) {
+        io_need_timeout(remaining);
+        return 0;
+    }
+    log_(LOG_WARN, "Upstream %s timed out\n", proxy->upstream->name);
+    upstream_report(proxy->upstream, 0);
+    proxy_detach(proxy);
+    if (proxy->head_done) {
+        proxy_close(proxy);
+        proxy->state = PROXY_FAILED;
+    } else {
+        proxy_fail(proxy, GATEWAY_TIMEOUT);
+    }
+    return 1;
+}
+
+void proxy_init(Proxy* proxy, UpstreamGroup* group, Request* request, struct in_addr addr, int is_tls) {
+    char remote_addr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr, remote_addr, sizeof(remote_addr));
+    proxy->group = group;
+    proxy->upstream = NULL;
+    proxy->attached = 0;
+    proxy->attempts = 0;
+    proxy->fd = -1;
+    proxy->reused = 0;
+    proxy->request = request;
+    proxy->req_content_length = 0;
+    proxy->req_head = NULL;
+    proxy->head_len = 0;
+    proxy->head_done = 0;
+    proxy->res_head = NULL;
+    proxy->res_head_len = proxy->res_head_sent = 0;
+    proxy->body_begin = proxy->body_len = 0;
+    proxy->framing = PROXY_UNTIL_EOF;
+    proxy->remaining = 0;
+    proxy->chunk_state = CHUNK_SIZE;
+    proxy->body_done = 0;
+    proxy->keep_alive = 0;
+    proxy->last_req = request_connection_close(request);
+    proxy->error = OK;
+    touch(proxy);
+    if (request->content_length < 0) {
+        proxy_fail(proxy, BAD_REQUEST);
+        return;
+    }
+    build_request_head(proxy, remote_addr, is_tls);
+    proxy_connect(proxy, upstream_pick(group, request));
+}
+
+int proxy_need_body(Proxy* proxy) {
+    return proxy->state == PROXY_SEND && proxy->req_head_sent == proxy->req_head_len
+           && proxy->req_content_length < proxy->request->content_length;
+}
+
+static int proxy_finish_connect(Proxy* proxy) {
+    if (io_wait_write(proxy->fd)) {
+        return 0;
+    }
+    struct pollfd pfd = {proxy->fd, POLLOUT, 0};
+    if (poll(&pfd, 1, 0) == 0) {
+        io_need_write(proxy->fd);
+        return 0;
+    }
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(proxy->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+        log_(LOG_WARN, "Error connecting to upstream %s: %s\n", proxy->upstream->name, strerror(err));
+        upstream_error(proxy);
+        return 1;
+    }
+    proxy->state = PROXY_SEND;
+    return 1;
+}
+
+int proxy_write(Proxy* proxy, Buffer* buf) {
+    if (proxy->state == PROXY_CONNECT) {
+        return is_timed_out(proxy) || proxy_finish_connect(proxy);
+    }
+    if (proxy->state != PROXY_SEND) {
+        log_(LOG_WARN, "proxy_write is called when proxy state isn't PROXY_SEND\n");
+        return 1;
+    }
+    const char* data;
+    int len;
+    int sending_head = proxy->req_head_sent < proxy->req_head_len;
+    if (sending_head) {
+        data = proxy->req_head + proxy->req_head_sent;
+        len = proxy->req_head_len - proxy->req_head_sent;
+    } else {
+        data = buffer_output_ptr(buf);
+        len = min(buffer_output_size(buf), proxy->request->content_length - proxy->req_content_length);
+    }
+    if (len > 0) {
+        if (is_timed_out(proxy)) {
+            return 1;
+        }
+        if (io_wait_write(proxy->fd)) {
+            return 0;
+        }
+        int ret = send(proxy->fd, data, len, MSG_NOSIGNAL);
+        if (ret < 0) {
+            switch (errno) {
+                case EAGAIN:
+                    io_need_write(proxy->fd);
+                    return 0;
+                default:
+                    upstream_error(proxy);
+                    return 1;
+            }
+        }
+        touch(proxy);
+        if (sending_head) {
+            proxy->req_head_sent += ret;
+        } else {
+            buffer_output(buf, ret);
+            proxy->req_content_length += ret;
+        }
+        log_(LOG_DEBUG, "Send %d byte(s) to upstream\n", ret);
+    }
+    if (proxy->req_head_sent == proxy->req_head_len
+        && proxy->req_content_length == proxy->request->content_length) {
+        proxy->state = PROXY_RECV;
+    }
+    return 1;
+}
+
+static int hex_value(char ch) {
+    if (ch >= '0' && ch <= '9') {
+        return ch - '0';
+    } else if (ch >= 'a' && ch <= 'f') {
+        return ch - 'a' + 10;
+    } else if (ch >= 'A' && ch <= 'F') {
+        return ch - 'A' + 10;
+    }
+    return -1;
+}
+
+static void chunk_size_end(Proxy* proxy) {
+    proxy->chunk_state = proxy->remaining == 0 ? CHUNK_TRAILER : CHUNK_DATA;
+}
+
+/*
+ * Follow the chunked encoding without decoding it, the chunks are relayed
+ * as they are. Returns the number of bytes up to the end of the message or
+ * -1 if the encoding is broken.
+ */
+static int scan_chunked(Proxy* proxy, const char* data, int len) {
+    int i = 0;
+    while (i < len && proxy->chunk_state != CHUNK_DONE) {
+        char ch = data[i];
+        switch (proxy->chunk_state) {
+            case CHUNK_SIZE:
+                if (hex_value(ch) >= 0) {
+                    if (proxy->remaining > (1LL << 40)) {
+                        return -1;
+                    }
+                    proxy->remaining = proxy->remaining * 16 + hex_value(ch);
+                } else if (ch == '\n') {
+                    chunk_size_end(proxy);
+                } else if (ch == ';' || ch == ' ' || ch == '\t' || ch == '\r') {
+                    proxy->chunk_state = CHUNK_EXT;
+                } else {
+                    return -1;
+                }
+                ++i;
+                break;
+            case CHUNK_EXT:
+                if (ch == '\n') {
+                    chunk_size_end(proxy);
+                }
+                ++i;
+                break;
+            case CHUNK_DATA: {
+                int n = (int) (proxy->remaining < len - i ? proxy->remaining : len - i);
+                proxy->remaining -= n;
+                i += n;
+                if (proxy->remaining == 0) {
+                    proxy->chunk_state = CHUNK_DATA_END;
+                }
+            }
+                break;
+            case CHUNK_DATA_END:
+                if (ch == '\n') {
+                    proxy->chunk_state = CHUNK_SIZE;
+                } else if (ch != '\r') {
+                    return -1;
+                }
+                ++i;
+                break;
+            case CHUNK_TRAILER:
+                if (ch == '\n') {
+                    proxy->chunk_state = CHUNK_DONE;
+                } else if (ch != '\r') {
+                    proxy->chunk_state = CHUNK_TRAILER_LINE;
+                }
+                ++i;
+                break;
+            case CHUNK_TRAILER_LINE:
+                if (ch == '\n') {
+                    proxy->chunk_state = CHUNK_TRAILER;
+                }
+                ++i;
+                break;
+            default:
+                break;
+        }
+    }
+    proxy->body_done = proxy->chunk_state == CHUNK_DONE;
+    return i;
+}
+
+// returns the number of bytes which belong to the response, or -1 if it can't be followed
+static int scan_body(Proxy* proxy, const char* data, int len) {
+    int n;
+    switch (proxy->framing) {
+        case PROXY_NO_BODY:
+            proxy->body_done = 1;
+            n = 0;
+            break;
+        case PROXY_LENGTH:
+            n = (int) (proxy->remaining < len ? proxy->remaining : len);
+            proxy->remaining -= n;
+            proxy->body_done = proxy->remaining == 0;
+            break;
+        case PROXY_CHUNKED:
+            n = scan_chunked(proxy, data, len);
+            break;
+        default:
+            n = len;
+            break;
+    }
+    if (n >= 0 && n < len) {
+        // the upstream sent more than the response, its connection can't be trusted
+        log_(LOG_WARN, "Upstream %s sent %d byte(s) past the response\n", proxy->upstream->name, len - n);
+        proxy->keep_alive = 0;
+    }
+    return n;
+}
+
+static int header_is(const char* name, int name_len, const char* expected) {
+    return name_len == strlen(expected) && !strncasecmp(name, expected, name_len);
+}
+
+static int has_token(const char* value, int value_len, const char* token) {
+    char* copy = new_strn(value, value_len);
+    copy[value_len] = 0;
+    int found = 0;
+    char* saveptr;
+    char* p;
+    for (p = strtok_r(copy, ", \t", &saveptr); p != NULL && !found; p = strtok_r(NULL, ", \t", &saveptr)) {
+        found = !strcasecmp(p, token);
+    }
+    free(copy);
+    return found;
+}
+
+/*
+ * Work out the framing and the persistence of the response, and build the
+ * head passed on to the client without the upstream's hop-by-hop headers.
+ */
+static void inspect_head(Proxy* proxy, int status_code, int is_http10, char* end) {
+    int has_length = 0;
+    int chunked = 0;
+    proxy->keep_alive = !is_http10;
+    proxy->res_head = (char*) malloc(end - proxy->head + 32);
+    char* p = proxy->res_head;
+    char* line = proxy->head;
+    int first = 1;
+    while (line < end) {
+        char* eol = memchr(line, '\n', end - line);
+        eol = eol != NULL ? eol + 1 : end;
+        char* colon = memchr(line, ':', eol - line);
+        if (!first && colon != NULL) {
+            char* value = colon + 1;
+            char* value_end = eol;
+            while (value < value_end && (*value == ' ' || *value == '\t')) {
+                ++value;
+            }
+            while (value_end > value && (value_end[-1] == '\r' || value_end[-1] == '\n' || value_end[-1] == ' ')) {
+                --value_end;
+            }
+            int name_len = colon - line;
+            if (header_is(line, name_len, "Connection")) {
+                if (has_token(value, value_end - value, "close")) {
+                    proxy->keep_alive = 0;
+                } else if (has_token(value, value_end - value, "keep-alive")) {
+                    proxy->keep_alive = 1;
+                }
+            } else if (header_is(line, name_len, "Transfer-Encoding")) {
+                chunked = has_token(value, value_end - value, "chunked");
+            } else if (header_is(line, name_len, "Content-Length")) {
+                has_length = 1;
+                proxy->remaining = atoll(value);
+            }
+            if (is_hop_by_hop(line, name_len)) {
+                line = eol;
+                continue;
+            }
+        }
+        first = 0;
+        memcpy(p, line, eol - line);
+        p += eol - line;
+        line = eol;
+    }
+    if (!strcmp(proxy->request->http_method, "HEAD") || status_code == 204 || status_code == 304) {
+        proxy->framing = PROXY_NO_BODY;
+    } else if (chunked) {
+        proxy->framing = PROXY_CHUNKED;
+        proxy->remaining = 0;
+    } else if (has_length) {
+        proxy->framing = PROXY_LENGTH;
+    } else {
+        // the end of the response is only known when the upstream closes, so is it for the client
+        proxy->framing = PROXY_UNTIL_EOF;
+        proxy->keep_alive = 0;
+        proxy->last_req = 1;
+    }
+    if (proxy->last_req) {
+        p += sprintf(p, "Connection: close\r\n");
+    }
+    p += sprintf(p, "\r\n");
+    proxy->res_head_len = p - proxy->res_head;
+}
+
+static int read_head(Proxy* proxy) {
+    if (io_wait_read(proxy->fd)) {
+        return 0;
+    }
+    int ret = recv(proxy->fd, proxy->head + proxy->head_len, PROXY_HEAD_MAX_SIZE - proxy->head_len, 0);
+    if (ret < 0) {
+        switch (errno) {
+            case EAGAIN:
+                io_need_read(proxy->fd);
+                return 0;
+            default:
+                upstream_error(proxy);
+                return 1;
+        }
+    } else if (ret == 0) {
+        upstream_error(proxy);
+        return 1;
+    }
+    touch(proxy);
+    proxy->head_len += ret;
+    char* end;
+    int status_code, is_http10, body_begin;
+    // a final head often arrives along with the interim ones
+    while (1) {
+        end = memmem(proxy->head, proxy->head_len, "\r\n\r\n", 4);
+        if (end == NULL) {
+            if (proxy->head_len == PROXY_HEAD_MAX_SIZE) {
+                log_(LOG_WARN, "The response head of upstream %s is too large\n", proxy->upstream->name);
+                proxy_fail(proxy, BAD_GATEWAY);
+            }
+            return 1;
+        }
+        end += 2;
+        status_code = 0;
+        is_http10 = !strncmp(proxy->head, "HTTP/1.0 ", 9);
+        if ((!is_http10 && strncmp(proxy->head, "HTTP/1.1 ", 9)) || (status_code = atoi(proxy->head + 9)) < 100) {
+            log_(LOG_WARN, "Upstream %s sent an invalid response\n", proxy->upstream->name);
+            proxy_fail(proxy, BAD_GATEWAY);
+            return 1;
+        }
+        body_begin = end + 2 - proxy->head;
+        if (status_code >= 200) {
+            break;
+        }
+        // interim responses aren't passed on
+        proxy->head_len -= body_begin;
+        memmove(proxy->head, proxy->head + body_begin, proxy->head_len);
+    }
+    upstream_report(proxy->upstream, 1);
+    inspect_head(proxy, status_code, is_http10, end);
+    proxy->head_done = 1;
+    proxy->body_begin = body_begin;
+    proxy->body_len = scan_body(proxy, proxy->head + body_begin, proxy->head_len - body_begin);
+    if (proxy->body_len < 0) {
+        proxy_fail(proxy, BAD_GATEWAY);
+    }
+    return 1;
+}
+
+static void proxy_finish(Proxy* proxy) {
+    proxy_detach(proxy);
+    if (proxy->keep_alive) {
+        upstream_release(proxy->upstream, proxy->fd);
+    } else {
+        close(proxy->fd);
+    }
+    proxy->fd = -1;
+    proxy->state = PROXY_FINISHED;
+}
+
+int proxy_read(Proxy* proxy, Buffer* buf) {
+    if (proxy->state == PROXY_ERROR) {
+        if (!buffer_is_empty(buf)) {
+            return 0;
+        }
+        Response* response = response_error(proxy->error);
+        response_add_header(response, "Connection", "close");
+        buffer_init_by_response(buf, response);
+        response_destroy(response);
+        free(response);
+        proxy->state = PROXY_FINISHED;
+        return 1;
+    }
+    if (proxy->state != PROXY_RECV) {
+        log_(LOG_WARN, "proxy_read is called when proxy state isn't PROXY_RECV\n");
+        return 1;
+    }
+    if (!proxy->head_done) {
+        return is_timed_out(proxy) || read_head(proxy);
+    }
+    int len;
+    if (proxy->res_head_sent < proxy->res_head_len) {
+        len = min(buffer_input_size(buf), proxy->res_head_len - proxy->res_head_sent);
+        memcpy(buffer_input_ptr(buf), proxy->res_head + proxy->res_head_sent, len);
+        buffer_input(buf, len);
+        proxy->res_head_sent += len;
+        return 1;
+    }
+    if (proxy->body_len > 0) {
+        len = min(buffer_input_size(buf), proxy->body_len);
+        memcpy(buffer_input_ptr(buf), proxy->head + proxy->body_begin, len);
+        buffer_input(buf, len);
+        proxy->body_begin += len;
+        proxy->body_len -= len;
+        return 1;
+    }
+    if (proxy->body_done) {
+        proxy_finish(proxy);
+        return 1;
+    }
+    if (is_timed_out(proxy)) {
+        return 1;
+    }
+    if (io_wait_read(proxy->fd)) {
+        return 0;
+    }
+    len = buffer_input_size(buf);
+    if (proxy->framing == PROXY_LENGTH && proxy->remaining < len) {
+        len = (int) proxy->remaining;
+    }
+    int ret = recv(proxy->fd, buffer_input_ptr(buf), len, 0);
+    if (ret < 0) {
+        switch (errno) {
+            case EAGAIN:
+                io_need_read(proxy->fd);
+                return 0;
+            default:
+                upstream_error(proxy);
+                return 1;
+        }
+    } else if (ret == 0) {
+        if (proxy->framing == PROXY_UNTIL_EOF) {
+            proxy->body_done = 1;
+        } else {
+            log_(LOG_WARN, "Upstream %s closed the connection before the end of the response\n",
+                 proxy->upstream->name);
+            upstream_error(proxy);
+        }
+        return 1;
+    }
+    touch(proxy);
+    int n = scan_body(proxy, buffer_input_ptr(buf), ret);
+    if (n < 0) {
+        log_(LOG_WARN, "Upstream %s sent a malformed chunked response\n", proxy->upstream->name);
+        proxy->keep_alive = 0;
+        upstream_error(proxy);
+        return 1;
+    }
+    buffer_input(buf, n);
+    log_(LOG_DEBUG, "Receive %d byte(s) from upstream\n", n);
+    return 1;
+}
+
+void proxy_destroy(Proxy* proxy) {
+    proxy_detach(proxy);
+    proxy_close(proxy);
+    free(proxy->req_head);
+    free(proxy->res_head);
+    request_destroy(proxy->request);
+    free(proxy->request);
+}
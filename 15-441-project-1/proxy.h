@@ -0,0 +1,98 @@
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include <netinet/in.h>
+
+#include "http.h"
+#include "buffer.h"
+#include "upstream.h"
+
+#define PROXY_HEAD_MAX_SIZE BUFFER_MAX_SIZE
+
+#define PROXY_DEFAULT_TIMEOUT 30000
+
+enum ProxyState {
+    PROXY_CONNECT,
+    PROXY_SEND,
+    PROXY_RECV,
+    PROXY_FAILED,
+    PROXY_ERROR,
+    PROXY_FINISHED
+};
+
+typedef enum ProxyState ProxyState;
+
+// how the end of the upstream response is found
+enum ProxyFraming {
+    PROXY_NO_BODY,
+    PROXY_LENGTH,
+    PROXY_CHUNKED,
+    PROXY_UNTIL_EOF
+};
+
+typedef enum ProxyFraming ProxyFraming;
+
+enum ChunkState {
+    CHUNK_SIZE,
+    CHUNK_EXT,
+    CHUNK_DATA,
+    CHUNK_DATA_END,
+    CHUNK_TRAILER,
+    CHUNK_TRAILER_LINE,
+    CHUNK_DONE
+};
+
+typedef enum ChunkState ChunkState;
+
+struct Proxy {
+    UpstreamGroup* group;
+    // the server of the current attempt, counted in its outstanding requests while attached
+    Upstream* upstream;
+    int attached;
+    int attempts;
+    int fd;
+    int reused;
+    Request* request;
+    int req_content_length;
+    // the request head as it's forwarded
+    char* req_head;
+    int req_head_len;
+    int req_head_sent;
+    // the response head as received, and as it's passed on to the client
+    char head[PROXY_HEAD_MAX_SIZE];
+    int head_len;
+    int head_done;
+    char* res_head;
+    int res_head_len;
+    int res_head_sent;
+    // body bytes received along with the head
+    int body_begin;
+    int body_len;
+    ProxyFraming framing;
+    long long remaining;
+    ChunkState chunk_state;
+    int body_done;
+    int keep_alive;
+    int last_req;
+    long long deadline;
+    StatusCode error;
+    ProxyState state;
+};
+
+typedef struct Proxy Proxy;
+
+// upstreams not making progress for this long fail the request, 0 for no limit
+void proxy_set_timeout(int timeout);
+
+void proxy_init(Proxy* proxy, UpstreamGroup* group, Request* request, struct in_addr addr, int is_tls);
+
+// whether the rest of the request body has to be received from the client first
+int proxy_need_body(Proxy* proxy);
+
+int proxy_write(Proxy* proxy, Buffer* buf);
+
+int proxy_read(Proxy* proxy, Buffer* buf);
+
+void proxy_destroy(Proxy* proxy);
+
+#endif
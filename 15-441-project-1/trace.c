@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+#include "utils.h"
+#include "log.h"
+
+int trace_enabled = 0;
+
+static char* trace_file;
+
+// rings are pushed once per thread and live until trace_cleanup
+static TraceRing* rings;
+static __thread TraceRing* local;
+
+static TraceRing* ring() {
+    if (local == NULL) {
+        local = (TraceRing*) calloc(1, sizeof(TraceRing));
+        local->tid = syscall(SYS_gettid);
+        do {
+            local->link = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+        } while (!__atomic_compare_exchange_n(&rings, &(local->link), local, 0, __ATOMIC_RELEASE,
+                                              __ATOMIC_RELAXED));
+    }
+    return local;
+}
+
+void trace_init(const char* filename) {
+    if (filename == NULL) {
+        return;
+    }
+    trace_file = new_str(filename);
+    trace_enabled = 1;
+    ring();
+}
+
+long long trace_now() {
+    return get_monotonic_time_us();
+}
+
+void trace_record(const char* name, long long start, int arg) {
+    TraceRing* r = ring();
+    TraceEvent* event = &(r->events[r->next % TRACE_RING_SIZE]);
+    event->name = name;
+    event->start = start;
+    event->duration = get_monotonic_time_us() - start;
+    event->arg = arg;
+    __atomic_store_n(&(r->next), r->next + 1, __ATOMIC_RELEASE);
+}
+
+void trace_dump() {
+    if (!trace_enabled) {
+        return;
+    }
+    FILE* file = fopen(trace_file, "w");
+    if (file == NULL) {
+        log_(LOG_ERROR, "Error opening the trace file %s\n", trace_file);
+        return;
+    }
+    int pid = getpid(), count = 0;
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", file);
+    TraceRing* r;
+    for (r = rings; r != NULL; r = r->link) {
+        unsigned int end = __atomic_load_n(&(r->next), __ATOMIC_ACQUIRE);
+        unsigned int i = end > TRACE_RING_SIZE ? end - TRACE_RING_SIZE : 0;
+        for (; i != end; ++i) {
+            TraceEvent* event = &(r->events[i % TRACE_RING_SIZE]);
+            fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%d,"
+                          "\"args\":{\"fd\":%d}}",
+                    count++ ? ",\n" : "", event->name, event->start, event->duration, pid, r->tid, event->arg);
+        }
+    }
+    fputs("\n]}\n", file);
+    fclose(file);
+    log_(LOG_INFO, "Dump %d trace event(s) to %s\n", count, trace_file);
+}
+
+void trace_cleanup() {
+    while (rings != NULL) {
+        TraceRing* link = rings->link;
+        free(rings);
+        rings = link;
+    }
+    local = NULL;
+    free(trace_file);
+    trace_file = NULL;
+    trace_enabled = 0;
+}
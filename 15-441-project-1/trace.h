@@ -0,0 +1,53 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+// the last TRACE_RING_SIZE spans of every thread are kept
+#define TRACE_RING_SIZE (1 << 16)
+
+struct TraceEvent {
+    const char* name;
+    long long start;
+    long long duration;
+    int arg;
+};
+
+typedef struct TraceEvent TraceEvent;
+
+struct TraceRing {
+    TraceEvent events[TRACE_RING_SIZE];
+    unsigned int next;
+    int tid;
+    struct TraceRing* link;
+};
+
+typedef struct TraceRing TraceRing;
+
+extern int trace_enabled;
+
+/*
+ * A span is measured between TRACE_BEGIN and TRACE_END in the same block,
+ * name is a string literal and arg, usually a fd, is shown in the viewer.
+ * Nothing but the trace_enabled test is left when tracing is off.
+ */
+#define TRACE_BEGIN(span) long long span = trace_enabled ? trace_now() : 0
+
+#define TRACE_END(span, name, arg) \
+    do { \
+        if (span) { \
+            trace_record(name, span, arg); \
+        } \
+    } while (0)
+
+// filename NULL disables tracing
+void trace_init(const char* filename);
+
+long long trace_now();
+
+void trace_record(const char* name, long long start, int arg);
+
+// overwrites the file with the rings as Chrome trace event JSON, for chrome://tracing or Perfetto
+void trace_dump();
+
+void trace_cleanup();
+
+#endif
@@ -0,0 +1,407 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+
+#include "upstream.h"
+#include "utils.h"
+#include "log.h"
+#include "io.h"
+
+// every server is shared by the groups naming it, and so is its idle pool
+static Upstream* servers = NULL;
+static UpstreamGroup* groups = NULL;
+
+static int max_fails = UPSTREAM_DEFAULT_MAX_FAILS;
+static int fail_timeout = UPSTREAM_DEFAULT_FAIL_TIMEOUT;
+static int slow_start = UPSTREAM_DEFAULT_SLOW_START;
+
+static unsigned int hash(const char* str) {
+    unsigned int h = 2166136261u;
+    while (*str) {
+        h = (h ^ (unsigned char) *str++) * 16777619u;
+    }
+    // spread keys differing only in their last characters over the whole ring
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static Upstream* server_get(const char* name) {
+    Upstream* upstream;
+    for (upstream = servers; upstream != NULL; upstream = upstream->next) {
+        if (!strcmp(upstream->name, name)) {
+            return upstream;
+        }
+    }
+    const char* colon = strrchr(name, ':');
+    if (colon == NULL || colon == name || strlen(name) >= UPSTREAM_MAX_NAME_SIZE
+        || !is_valid_port(atoi(colon + 1))) {
+        log_(LOG_ERROR, "Invalid upstream address %s\n", name);
+        return NULL;
+    }
+    char host[UPSTREAM_MAX_NAME_SIZE];
+    memcpy(host, name, colon - name);
+    host[colon - name] = 0;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* res;
+    int err = getaddrinfo(host, colon + 1, &hints, &res);
+    if (err != 0) {
+        log_(LOG_ERROR, "Error resolving upstream %s: %s\n", name, gai_strerror(err));
+        return NULL;
+    }
+    upstream = (Upstream*) malloc(sizeof(Upstream));
+    strcpy(upstream->name, name);
+    memcpy(&(upstream->addr), res->ai_addr, sizeof(upstream->addr));
+    freeaddrinfo(res);
+    upstream->idle = NULL;
+    upstream->num_idle = 0;
+    upstream->outstanding = 0;
+    upstream->fails = 0;
+    upstream->down_until = 0;
+    upstream->up_since = 0;
+    upstream->next = servers;
+    servers = upstream;
+    return upstream;
+}
+
+static int compare_points(const void* a, const void* b) {
+    unsigned int x = ((const RingPoint*) a)->hash;
+    unsigned int y = ((const RingPoint*) b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+static void build_ring(UpstreamGroup* group) {
+    group->ring_size = group->num_servers * UPSTREAM_VNODES;
+    group->ring = (RingPoint*) malloc(sizeof(RingPoint) * group->ring_size);
+    char point[UPSTREAM_MAX_NAME_SIZE + 16];
+    int i, j;
+    for (i = 0; i != group->num_servers; ++i) {
+        for (j = 0; j != UPSTREAM_VNODES; ++j) {
+            sprintf(point, "%s#%d", group->servers[i]->name, j);
+            group->ring[i * UPSTREAM_VNODES + j].hash = hash(point);
+            group->ring[i * UPSTREAM_VNODES + j].upstream = group->servers[i];
+        }
+    }
+    qsort(group->ring, group->ring_size, sizeof(RingPoint), compare_points);
+}
+
+static int parse_policy(const char* name, int len, UpstreamPolicy* policy) {
+    if (len == 11 && !strncmp(name, "round-robin", len)) {
+        *policy = UPSTREAM_ROUND_ROBIN;
+    } else if (len == 10 && !strncmp(name, "least-conn", len)) {
+        *policy = UPSTREAM_LEAST_CONN;
+    } else if (len == 4 && !strncmp(name, "hash", len)) {
+        *policy = UPSTREAM_HASH;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+int upstream_add(const char* spec) {
+    const char* sep = strchr(spec, '=');
+    if (sep == NULL || sep == spec || sep - spec >= UPSTREAM_MAX_PREFIX_SIZE || spec[0] != '/') {
+        log_(LOG_ERROR, "Invalid upstream specification %s\n", spec);
+        return 0;
+    }
+    UpstreamGroup* group = (UpstreamGroup*) malloc(sizeof(UpstreamGroup));
+    memset(group, 0, sizeof(UpstreamGroup));
+    memcpy(group->prefix, spec, sep - spec);
+    group->prefix[sep - spec] = 0;
+    group->policy = UPSTREAM_ROUND_ROBIN;
+    const char* list = sep + 1;
+    const char* at = strchr(list, '@');
+    if (at != NULL) {
+        if (!parse_policy(list, at - list, &(group->policy))) {
+            log_(LOG_ERROR, "Unknown load balancing policy in %s\n", spec);
+            free(group);
+            return 0;
+        }
+        list = at + 1;
+    }
+    char* names = new_str(list);
+    char* saveptr;
+    char* name;
+    for (name = strtok_r(names, ",", &saveptr); name != NULL; name = strtok_r(NULL, ",", &saveptr)) {
+        Upstream* upstream = group->num_servers < UPSTREAM_MAX_SERVERS ? server_get(name) : NULL;
+        if (upstream == NULL) {
+            free(names);
+            free(group);
+            return 0;
+        }
+        group->servers[group->num_servers++] = upstream;
+    }
+    free(names);
+    if (group->num_servers == 0) {
+        log_(LOG_ERROR, "No upstream server in %s\n", spec);
+        free(group);
+        return 0;
+    }
+    if (group->policy == UPSTREAM_HASH) {
+        build_ring(group);
+    }
+    group->next = groups;
+    groups = group;
+    log_(LOG_INFO, "Forward %s to %s\n", group->prefix, sep + 1);
+    return 1;
+}
+
+void upstream_set_health(int fails, int timeout, int slow_start_ms) {
+    max_fails = fails;
+    fail_timeout = timeout;
+    slow_start = slow_start_ms;
+}
+
+UpstreamGroup* upstream_match(Request* request) {
+    UpstreamGroup* match = NULL;
+    int match_len = 0;
+    UpstreamGroup* group;
+    for (group = groups; group != NULL; group = group->next) {
+        int len = match_prefix(request->abs_path, group->prefix);
+        if (len > match_len) {
+            match = group;
+            match_len = len;
+        }
+    }
+    return match;
+}
+
+static int is_up(Upstream* upstream, long long now) {
+    return upstream->down_until <= now;
+}
+
+// in percent, a recovering server starts at a tenth of its share
+static int weight(Upstream* upstream, long long now) {
+    long long elapsed = now - upstream->up_since;
+    if (slow_start <= 0 || upstream->up_since == 0 || elapsed >= slow_start) {
+        return 100;
+    }
+    return 10 + (int) (elapsed * 90 / slow_start);
+}
+
+static Upstream* pick_round_robin(UpstreamGroup* group, long long now) {
+    int total = 0;
+    int best = -1;
+    int i;
+    for (i = 0; i != group->num_servers; ++i) {
+        if (!is_up(group->servers[i], now)) {
+            continue;
+        }
+        int w = weight(group->servers[i], now);
+        group->current[i] += w;
+        total += w;
+        if (best < 0 || group->current[i] > group->current[best]) {
+            best = i;
+        }
+    }
+    if (best < 0) {
+        return NULL;
+    }
+    group->current[best] -= total;
+    return group->servers[best];
+}
+
+static Upstream* pick_least_conn(UpstreamGroup* group, long long now) {
+    Upstream* best = NULL;
+    long long best_load = 0;
+    int start = group->next_server++ % group->num_servers;
+    int i;
+    for (i = 0; i != group->num_servers; ++i) {
+        Upstream* upstream = group->servers[(start + i) % group->num_servers];
+        if (!is_up(upstream, now)) {
+            continue;
+        }
+        long long load = (upstream->outstanding + 1) * 10000LL / weight(upstream, now);
+        if (best == NULL || load < best_load) {
+            best = upstream;
+            best_load = load;
+        }
+    }
+    return best;
+}
+
+static Upstream* pick_hash(UpstreamGroup* group, Request* request, long long now) {
+    unsigned int h = hash(request->abs_path);
+    int lo = 0, hi = group->ring_size;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (group->ring[mid].hash < h) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    // the next server clockwise which is up takes over the keys of a server which is down
+    int i;
+    for (i = 0; i != group->ring_size; ++i) {
+        Upstream* upstream = group->ring[(lo + i) % group->ring_size].upstream;
+        if (is_up(upstream, now)) {
+            return upstream;
+        }
+    }
+    return NULL;
+}
+
+Upstream* upstream_pick(UpstreamGroup* group, Request* request) {
+    long long now = get_monotonic_time_ms();
+    Upstream* upstream;
+    switch (group->policy) {
+        case UPSTREAM_LEAST_CONN:
+            upstream = pick_least_conn(group, now);
+            break;
+        case UPSTREAM_HASH:
+            upstream = pick_hash(group, request, now);
+            break;
+        default:
+            upstream = pick_round_robin(group, now);
+            break;
+    }
+    if (upstream == NULL) {
+        // all servers are down, try the one which is due back first rather than failing
+        int i;
+        for (i = 0; i != group->num_servers; ++i) {
+            if (upstream == NULL || group->servers[i]->down_until < upstream->down_until) {
+                upstream = group->servers[i];
+            }
+        }
+    }
+    return upstream;
+}
+
+void upstream_report(Upstream* upstream, int ok) {
+    if (ok) {
+        upstream->fails = 0;
+        return;
+    }
+    upstream->fails++;
+    if (max_fails > 0 && upstream->fails >= max_fails) {
+        long long now = get_monotonic_time_ms();
+        log_(LOG_WARN, "Upstream %s failed %d time(s) in a row, eject it for %d ms\n",
+             upstream->name, upstream->fails, fail_timeout);
+        upstream->fails = 0;
+        upstream->down_until = now + fail_timeout;
+        upstream->up_since = upstream->down_until;
+        // connections kept from before the failures are likely broken as well
+        while (upstream->idle != NULL) {
+            UpstreamConn* conn = upstream->idle;
+            upstream->idle = conn->next;
+            close(conn->fd);
+            free(conn);
+        }
+        upstream->num_idle = 0;
+    }
+}
+
+// an idle connection is usable if the server hasn't closed it or sent anything since
+static int is_alive(int fd) {
+    char ch;
+    int ret = recv(fd, &ch, 1, MSG_PEEK | MSG_DONTWAIT);
+    return ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+int upstream_acquire(Upstream* upstream, int* reused) {
+    long long now = get_monotonic_time_ms();
+    while (upstream->idle != NULL) {
+        UpstreamConn* conn = upstream->idle;
+        upstream->idle = conn->next;
+        upstream->num_idle--;
+        int fd = conn->fd;
+        int usable = now - conn->idle_since < UPSTREAM_IDLE_TIMEOUT && is_alive(fd);
+        free(conn);
+        if (usable) {
+            *reused = 1;
+            return fd;
+        }
+        close(fd);
+    }
+    *reused = 0;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_(LOG_ERROR, "Error creating a socket for upstream %s\n", upstream->name);
+        return -1;
+    }
+    enable_non_blocking(fd);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (struct sockaddr*) &(upstream->addr), sizeof(upstream->addr)) < 0 && errno != EINPROGRESS) {
+        log_(LOG_WARN, "Error connecting to upstream %s\n", upstream->name);
+        close(fd);
+        return -1;
+    }
+    log_(LOG_DEBUG, "Open a connection to upstream %s, fd = %d\n", upstream->name, fd);
+    return fd;
+}
+
+void upstream_release(Upstream* upstream, int fd) {
+    if (upstream->num_idle >= UPSTREAM_MAX_IDLE) {
+        close(fd);
+        return;
+    }
+    UpstreamConn* conn = (UpstreamConn*) malloc(sizeof(UpstreamConn));
+    conn->fd = fd;
+    conn->idle_since = get_monotonic_time_ms();
+    conn->next = upstream->idle;
+    upstream->idle = conn;
+    upstream->num_idle++;
+}
+
+// the idle list is ordered by release time, returns when the oldest connection left was released or -1
+static long long expire_idle(Upstream* upstream, long long now) {
+    UpstreamConn** p = &(upstream->idle);
+    long long oldest = -1;
+    while (*p != NULL && now - (*p)->idle_since < UPSTREAM_IDLE_TIMEOUT) {
+        oldest = (*p)->idle_since;
+        p = &((*p)->next);
+    }
+    while (*p != NULL) {
+        UpstreamConn* conn = *p;
+        *p = conn->next;
+        log_(LOG_DEBUG, "Close the idle connection to upstream %s, fd = %d\n", upstream->name, conn->fd);
+        close(conn->fd);
+        free(conn);
+        upstream->num_idle--;
+    }
+    return oldest;
+}
+
+void upstream_tick() {
+    long long now = get_monotonic_time_ms();
+    Upstream* upstream;
+    for (upstream = servers; upstream != NULL; upstream = upstream->next) {
+        long long oldest = expire_idle(upstream, now);
+        if (oldest >= 0) {
+            io_need_timeout(oldest + UPSTREAM_IDLE_TIMEOUT - now);
+        }
+    }
+}
+
+void upstream_cleanup() {
+    while (groups != NULL) {
+        UpstreamGroup* group = groups;
+        groups = group->next;
+        free(group->ring);
+        free(group);
+    }
+    while (servers != NULL) {
+        Upstream* upstream = servers;
+        servers = upstream->next;
+        while (upstream->idle != NULL) {
+            UpstreamConn* conn = upstream->idle;
+            upstream->idle = conn->next;
+            close(conn->fd);
+            free(conn);
+        }
+        free(upstream);
+    }
+}
@@ -0,0 +1,106 @@
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#include <netinet/in.h>
+
+#include "http.h"
+
+#define UPSTREAM_MAX_PREFIX_SIZE 256
+#define UPSTREAM_MAX_NAME_SIZE 256
+#define UPSTREAM_MAX_SERVERS 32
+
+// idle connections kept open per upstream and how long they may stay idle
+#define UPSTREAM_MAX_IDLE 32
+#define UPSTREAM_IDLE_TIMEOUT 60000
+
+// points per server on the consistent hash ring
+#define UPSTREAM_VNODES 160
+
+#define UPSTREAM_DEFAULT_MAX_FAILS 3
+#define UPSTREAM_DEFAULT_FAIL_TIMEOUT 10000
+#define UPSTREAM_DEFAULT_SLOW_START 10000
+
+enum UpstreamPolicy {
+    UPSTREAM_ROUND_ROBIN,
+    UPSTREAM_LEAST_CONN,
+    UPSTREAM_HASH
+};
+
+typedef enum UpstreamPolicy UpstreamPolicy;
+
+struct UpstreamConn {
+    int fd;
+    long long idle_since;
+    struct UpstreamConn* next;
+};
+
+typedef struct UpstreamConn UpstreamConn;
+
+// an http server requests are forwarded to
+struct Upstream {
+    char name[UPSTREAM_MAX_NAME_SIZE];
+    struct sockaddr_in addr;
+    // most recently released first
+    UpstreamConn* idle;
+    int num_idle;
+    // requests currently forwarded to it
+    int outstanding;
+    // passive health, the server is skipped until down_until after max_fails failures in a row
+    int fails;
+    long long down_until;
+    // when it came back, it gets a growing share of the traffic during slow start
+    long long up_since;
+    struct Upstream* next;
+};
+
+typedef struct Upstream Upstream;
+
+struct RingPoint {
+    unsigned int hash;
+    Upstream* upstream;
+};
+
+typedef struct RingPoint RingPoint;
+
+// the servers behind a path prefix
+struct UpstreamGroup {
+    char prefix[UPSTREAM_MAX_PREFIX_SIZE];
+    UpstreamPolicy policy;
+    Upstream* servers[UPSTREAM_MAX_SERVERS];
+    int num_servers;
+    // smooth weighted round robin state, and where least-conn starts breaking ties
+    int current[UPSTREAM_MAX_SERVERS];
+    int next_server;
+    RingPoint* ring;
+    int ring_size;
+    struct UpstreamGroup* next;
+};
+
+typedef struct UpstreamGroup UpstreamGroup;
+
+// spec is "<path prefix>=[<policy>@]<host>:<port>[,<host>:<port>...]",
+// policy is one of round-robin (the default), least-conn and hash
+int upstream_add(const char* spec);
+
+void upstream_set_health(int max_fails, int fail_timeout, int slow_start);
+
+UpstreamGroup* upstream_match(Request* request);
+
+// chooses the server for a request according to the policy of the group
+Upstream* upstream_pick(UpstreamGroup* group, Request* request);
+
+// passive health check, called with the outcome of every attempt
+void upstream_report(Upstream* upstream, int ok);
+
+// returns a non-blocking socket, connected or connecting, or -1
+int upstream_acquire(Upstream* upstream, int* reused);
+
+// keeps a connection which finished a response cleanly for the next request
+void upstream_release(Upstream* upstream, int fd);
+
+// closes the connections idle for longer than UPSTREAM_IDLE_TIMEOUT, call it after each io wait
+void upstream_tick();
+
+void upstream_cleanup();
+
+#endif
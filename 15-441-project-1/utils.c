@@ -1,6 +1,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <time.h>
 
 #include "utils.h"
 #include "log.h"
@@ -26,6 +27,7 @@ char* new_str(const char* str) {
 char* new_strn(const char* str, int n) {
     char* p = (char*)malloc(n + 1);
     strncpy(p, str, n);
+    p[n] = 0;
     return p; 
 }
 
@@ -66,4 +68,25 @@ void enable_non_blocking(int fd) {
     if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) {
         log_(LOG_ERROR, "return value of fcntl(%d, F_SETFL, %d) is non-zero\n", fd, flags | O_NONBLOCK);
     }
-}
\ No newline at end of file
+}
+
+long long get_monotonic_time_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+long long get_monotonic_time_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int match_prefix(const char* path, const char* prefix) {
+    int len = strlen(prefix);
+    if (len == 0 || strncmp(path, prefix, len) != 0) {
+        return 0;
+    }
+    char next = path[len];
+    return prefix[len - 1] == '/' || next == 0 || next == '/' || next == '?' ? len : 0;
+}
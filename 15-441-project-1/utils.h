@@ -21,4 +21,11 @@ void get_http_format_date(time_t* time, char* str, int size);
 
 void enable_non_blocking(int fd);
 
+long long get_monotonic_time_ms();
+
+long long get_monotonic_time_us();
+
+// returns the length of prefix if it matches path on a segment boundary, 0 otherwise
+int match_prefix(const char* path, const char* prefix);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "zygote.h"
+#include "io.h"
+#include "log.h"
+
+static pid_t zygote_pid = -1;
+
+static int zygote_sock = -1;
+
+static char envbuf[ZYGOTE_MAX_ENV_SIZE];
+
+// the requests sent, the zygote replies to them in order
+static void* pending[ZYGOTE_MAX_PENDING];
+static unsigned int pending_head;
+static unsigned int pending_tail;
+
+static void zygote_stop() {
+    if (zygote_sock >= 0) {
+        close(zygote_sock);
+        zygote_sock = -1;
+    }
+    if (zygote_pid > 0) {
+        kill(zygote_pid, SIGTERM);
+        waitpid(zygote_pid, NULL, 0);
+        zygote_pid = -1;
+    }
+}
+
+int zygote_init(const char* helper_path, const char* script_path) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+        log_(LOG_ERROR, "Error creating the zygote socket pair.\n");
+        return 0;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(sv[0]);
+        close(sv[1]);
+        log_(LOG_ERROR, "Error forking the zygote.\n");
+        return 0;
+    }
+    if (pid == 0) {
+        // the control socket becomes the zygote's stdin
+        close(sv[0]);
+        dup2(sv[1], fileno(stdin));
+        close(sv[1]);
+        execl(helper_path, helper_path, script_path, (char*) NULL);
+        _exit(EXIT_FAILURE);
+    }
+    close(sv[1]);
+    fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+    // the pids are read as they arrive, the loop never waits for the zygote
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+    zygote_sock = sv[0];
+    pending_head = pending_tail = 0;
+    zygote_pid = pid;
+    log_(LOG_INFO, "Create the cgi zygote, pid = %d, helper_path = %s\n", pid, helper_path);
+    return 1;
+}
+
+int zygote_is_running() {
+    return zygote_sock >= 0;
+}
+
+int zygote_spawn(char* const envp[], int infd, int outfd, void* ctx) {
+    if (!zygote_is_running() || pending_tail - pending_head == ZYGOTE_MAX_PENDING) {
+        return 0;
+    }
+    // the environment is sent as a sequence of NUL terminated strings
+    int len = 0;
+    int i;
+    for (i = 0; envp[i] != NULL; ++i) {
+        int n = strlen(envp[i]) + 1;
+        if (len + n > sizeof(envbuf)) {
+            log_(LOG_WARN, "The cgi environment is too large for the zygote\n");
+            return 0;
+        }
+        memcpy(envbuf + len, envp[i], n);
+        len += n;
+    }
+    struct iovec iov = {envbuf, len};
+    int fds[2] = {infd, outfd};
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(zygote_sock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT) != len) {
+        if (errno == EAGAIN) {
+            // the zygote is busy, this one is spawned directly
+            return 0;
+        }
+        log_(LOG_ERROR, "The cgi zygote stops responding, fall back to posix_spawn\n");
+        zygote_stop();
+        return 0;
+    }
+    pending[pending_tail++ % ZYGOTE_MAX_PENDING] = ctx;
+    io_need_read(zygote_sock);
+    return 1;
+}
+
+void zygote_poll(void (*spawned)(void* ctx, pid_t pid)) {
+    while (pending_head != pending_tail && zygote_is_running()) {
+        int32_t pid;
+        int ret = recv(zygote_sock, &pid, sizeof(pid), MSG_DONTWAIT);
+        if (ret < 0 && errno == EAGAIN) {
+            io_need_read(zygote_sock);
+            return;
+        }
+        if (ret != sizeof(pid)) {
+            // don't keep talking to a zygote which is dead or out of sync
+            log_(LOG_ERROR, "The cgi zygote stops responding, fall back to posix_spawn\n");
+            zygote_stop();
+            break;
+        }
+        if (pid <= 0) {
+            log_(LOG_ERROR, "The cgi zygote fails to fork.\n");
+        }
+        spawned(pending[pending_head++ % ZYGOTE_MAX_PENDING], pid);
+    }
+    // the requests a stopped zygote never replied to
+    while (pending_head != pending_tail) {
+        spawned(pending[pending_head++ % ZYGOTE_MAX_PENDING], -1);
+    }
+}
+
+void zygote_cleanup() {
+    zygote_stop();
+}
@@ -0,0 +1,33 @@
+#ifndef __ZYGOTE_H__
+#define __ZYGOTE_H__
+
+#include <sys/types.h>
+
+#define ZYGOTE_MAX_ENV_SIZE (1 << 16)
+// requests sent to the zygote whose pid hasn't arrived yet
+#define ZYGOTE_MAX_PENDING 256
+
+/*
+ * The zygote is a helper process started next to lisod which has the cgi
+ * script's interpreter and modules already loaded. For every cgi request,
+ * lisod passes the environment block and the two pipe ends over a unix
+ * socket, and the zygote forks a warm child that runs the script.
+ */
+int zygote_init(const char* helper_path, const char* script_path);
+
+int zygote_is_running();
+
+/*
+ * Sends the request without waiting for the zygote. Returns 0 if the zygote
+ * can't take it, the caller spawns the script itself then. Otherwise the pid
+ * is handed to the spawned callback of zygote_poll along with ctx, -1 if
+ * the fork failed.
+ */
+int zygote_spawn(char* const envp[], int infd, int outfd, void* ctx);
+
+// takes the pids the zygote replied with, call it after each io wait
+void zygote_poll(void (*spawned)(void* ctx, pid_t pid));
+
+void zygote_cleanup();
+
+#endif